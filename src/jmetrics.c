@@ -1,7 +1,14 @@
 #include "jmetrics.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JM_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #define INPUT_BUFFER_SIZE 102400
 #define MAX_SUM_COUNT 5
+#define SEED_RADIUS 8
+#define DCT_SAMPLE_STEP 8
 
 float clamp(float low, float value, float high)
 {
@@ -77,698 +84,3385 @@ int interpolate(const unsigned char *image, int width, int components, float x,
     return pix;
 }
 
-float metric_mpe(const unsigned char *original, const unsigned char *compressed, int width, int height, int components)
+// Threads for metric bands and the components of combined methods,
+// 0 - all CPUs
+static int metricThreads = 0;
+
+void MetricSetThreads(int threads)
 {
-    int y, x, z;
-    float delta, pmel, pme;
-    unsigned long int k;
+    metricThreads = threads;
+}
 
-    k = 0;
-    pme = 0.0f;
-    for (y = 0; y < height; y++)
-    {
-        pmel = 0.0f;
-        for (x = 0; x < width; x++)
-        {
-            for (z = 0; z < components; z++)
-            {
-                delta = abs(original[k] - compressed[k]);
-                pmel += delta;
-                k++;
-            }
-        }
-        pme += pmel;
-    }
-    pme /= (float)k;
+static int metricThreadCount(void)
+{
+    return (metricThreads < 1) ? cpuCount() : metricThreads;
+}
+
+/*
+    Integer pixel kernels. Sums go to 64 bits; the SIMD versions keep
+    32-bit lanes for at most KERNEL_FLUSH vectors, well below overflow
+    even for four squares per lane, before widening them.
+*/
+#define KERNEL_FLUSH 2048
+
+// Smallest share of a buffer worth handing to another thread
+#define PIXEL_BAND (1 << 20)
+
+static uint64_t sadScalar(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        sum += abs(a[i] - b[i]);
 
-    return pme;
+    return sum;
 }
 
-float metric_mse(const unsigned char *ref, const unsigned char *cmp, int width, int height, int channels)
+static uint64_t ssdScalar(const unsigned char *a, const unsigned char *b, size_t n)
 {
-    float im1, im2;
-    float suml, sum, delta;
-    int y, x, d;
-    size_t k;
+    uint64_t sum = 0;
+    size_t i;
+    int d;
 
-    k = 0;
-    sum = 0.0f;
-    for (y = 0; y < height; y++)
+    for (i = 0; i < n; i++)
     {
-        suml = 0.0f;
-        for (x = 0; x < width; x++)
-        {
-            for (d = 0; d < channels; d++)
-            {
-                im1 = (float)ref[k];
-                im2 = (float)cmp[k];
-                delta = (im1 > im2) ? (im1 - im2) : (im2 - im1);
-                suml += delta * delta;
-                k++;
-            }
-        }
-        sum += suml;
+        d = a[i] - b[i];
+        sum += d * d;
     }
-    sum /= (float)k;
 
     return sum;
 }
 
-float metric_stdev2(const unsigned char *ref, const unsigned char *cmp, int width, int height, int channels)
+static void momentsScalar(const unsigned char *a, const unsigned char *b, size_t n, uint64_t *sum, uint64_t *sumSq)
 {
-    float im1, im2;
-    float suml, sum, sumql, sumq, stdev2;
-    int y, x, d;
-    size_t k, n;
+    uint64_t s = 0, q = 0;
+    size_t i;
 
-    n = 2 * width * height;
-    stdev2 = 0.0f;
-    for (d = 0; d < channels; d++)
+    for (i = 0; i < n; i++)
     {
-        k = d;
-        sum = 0.0f;
-        sumq = 0.0f;
-        for (y = 0; y < height; y++)
-        {
-            suml = 0.0f;
-            sumql = 0.0f;
-            for (x = 0; x < width; x++)
-            {
-                im1 = (float)ref[k];
-                im2 = (float)cmp[k];
-                suml += im1;
-                suml += im2;
-                sumql += (im1 * im1);
-                sumql += (im2 * im2);
-                k += channels;
-            }
-            sum += suml;
-            sumq += sumql;
-        }
-        sum /= (float)n;
-        sumq /= (float)n;
-        sumq -= sum * sum;
-        stdev2 += sumq;
+        s += a[i] + b[i];
+        q += a[i] * a[i] + b[i] * b[i];
     }
-    stdev2 /= (float)channels;
 
-    return stdev2;
+    *sum = s;
+    *sumSq = q;
 }
 
-float metric_msef(const unsigned char *ref, const unsigned char *cmp, int width, int height, int channels)
+// Y of RGB pixels with the fixed point weights of jccolor.c
+static void lumaScalar(const unsigned char *rgb, unsigned char *gray, size_t n)
 {
-    float mse, stdev2;
+    size_t i;
 
-    mse = metric_mse(ref, cmp, width, height, channels);
-    stdev2 = metric_stdev2(ref, cmp, width, height, channels);
-    stdev2 = (stdev2 > 0.0f) ? stdev2 : 1.0f;
-    mse /= stdev2;
-    mse = sqrt(mse);
-
-    return mse;
+    for (i = 0; i < n; i++, rgb += 3)
+        gray[i] = (19595 * rgb[0] + 38470 * rgb[1] + 7471 * rgb[2] + 32768) >> 16;
 }
 
-void defish(const unsigned char *input, unsigned char *output, int width, int height, int components, float strength, float zoom)
+// Differing bits of two packed hashes, counted in parallel within each word
+static uint64_t hammingScalar(const uint64_t *a, const uint64_t *b, size_t words)
 {
-    const int cx = width / 2;
-    const int cy = height / 2;
-    const float len = sqrt(width * width + height * height);
-    int y, x, z;
-    float dx, dy, r, theta = 1.0f;
-    unsigned long int k;
+    uint64_t sum = 0, v;
+    size_t i;
 
-    k = 0;
-    for (y = 0; y < height; y++)
+    for (i = 0; i < words; i++)
     {
-        for (x = 0; x < width; x++)
-        {
-            dx = (cx - x) * zoom;
-            dy = (cy - y) * zoom;
-            r = sqrt(dx * dx + dy * dy) / len * strength;
-            theta = 1.0f;
+        v = a[i] ^ b[i];
+        v -= (v >> 1) & 0x5555555555555555ULL;
+        v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+        v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        sum += (v * 0x0101010101010101ULL) >> 56;
+    }
 
-            if (r != 0.0f)
-            {
-                theta = atan(r) / r;
-            }
+    return sum;
+}
 
-            dx = clamp(0.0f, 0.5f * width - theta * dx, width);
-            dy = clamp(0.0f, 0.5f * height - theta * dy, height);
+#ifdef JM_X86_SIMD
+__attribute__((target("sse2")))
+static uint64_t sadSse2(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    __m128i acc = _mm_setzero_si128();
+    uint64_t lanes[2];
+    size_t i;
 
-            for (z = 0; z < components; z++)
-            {
-                output[k] = interpolate(input, width, components, dx, dy, z);
-                k++;
-            }
-        }
-    }
+    for (i = 0; i + 16 <= n; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (a + i)),
+                                              _mm_loadu_si128((const __m128i *) (b + i))));
+
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    return lanes[0] + lanes[1] + sadScalar(a + i, b + i, n - i);
 }
 
-unsigned long int grayscale(const unsigned char *input, unsigned char **output, int width, int height)
+__attribute__((target("sse2")))
+static uint64_t ssdSse2(const unsigned char *a, const unsigned char *b, size_t n)
 {
-    int y, x;
-    float r = 0.299f, g = 0.587f, b = 0.114f, c = 0.5f;
-    unsigned long int k, k3;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero, lanes32, va, vb, d, lo, hi;
+    uint64_t lanes[2];
+    size_t i = 0, end;
 
-    *output = malloc(width * height);
-
-    k = k3 = 0;
-    for (y = 0; y < height; y++)
+    while (n - i >= 16)
     {
-        for (x = 0; x < width; x++)
+        lanes32 = zero;
+        end = i + MIN((n - i) / 16, KERNEL_FLUSH) * 16;
+        for (; i < end; i += 16)
         {
-            // Y = 0.299R + 0.587G + 0.114B
-            (*output)[k] = input[k3] * r +
-                           input[k3 + 1] * g +
-                           input[k3 + 2] * b + c;
-            k++;
-            k3 += 3;
+            va = _mm_loadu_si128((const __m128i *) (a + i));
+            vb = _mm_loadu_si128((const __m128i *) (b + i));
+            d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+            lo = _mm_unpacklo_epi8(d, zero);
+            hi = _mm_unpackhi_epi8(d, zero);
+            lanes32 = _mm_add_epi32(lanes32, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
         }
+        acc = _mm_add_epi64(acc, _mm_add_epi64(_mm_unpacklo_epi32(lanes32, zero), _mm_unpackhi_epi32(lanes32, zero)));
     }
 
-    return k;
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    return lanes[0] + lanes[1] + ssdScalar(a + i, b + i, n - i);
 }
 
-void scale(unsigned char *image, int width, int height, unsigned char **newImage, int newWidth, int newHeight)
+__attribute__((target("sse2")))
+static void momentsSse2(const unsigned char *a, const unsigned char *b, size_t n, uint64_t *sum, uint64_t *sumSq)
 {
-    int y, x, oldY, oldX;
-    unsigned long int k, size;
-
-    size = (unsigned long int) newWidth * newHeight;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i accSum = zero, accSq = zero, lanes32, va, vb, lo, hi;
+    uint64_t lanes[2], tailSum, tailSq;
+    size_t i = 0, end;
 
-    *newImage = malloc(size);
-
-    k = 0;
-    for (y = 0; y < newHeight; y++)
+    while (n - i >= 16)
     {
-        for (x = 0; x < newWidth; x++)
+        lanes32 = zero;
+        end = i + MIN((n - i) / 16, KERNEL_FLUSH) * 16;
+        for (; i < end; i += 16)
         {
-            oldY = (float) y / newHeight * height + 0.5f;
-            oldX = (float) x / newWidth * width + 0.5f;
-
-            (*newImage)[k] = image[oldY * width + oldX];
-            k++;
-
+            va = _mm_loadu_si128((const __m128i *) (a + i));
+            vb = _mm_loadu_si128((const __m128i *) (b + i));
+            accSum = _mm_add_epi64(accSum, _mm_add_epi64(_mm_sad_epu8(va, zero), _mm_sad_epu8(vb, zero)));
+            lo = _mm_unpacklo_epi8(va, zero);
+            hi = _mm_unpackhi_epi8(va, zero);
+            lanes32 = _mm_add_epi32(lanes32, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+            lo = _mm_unpacklo_epi8(vb, zero);
+            hi = _mm_unpackhi_epi8(vb, zero);
+            lanes32 = _mm_add_epi32(lanes32, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
         }
+        accSq = _mm_add_epi64(accSq, _mm_add_epi64(_mm_unpacklo_epi32(lanes32, zero), _mm_unpackhi_epi32(lanes32, zero)));
     }
+
+    momentsScalar(a + i, b + i, n - i, &tailSum, &tailSq);
+    _mm_storeu_si128((__m128i *) lanes, accSum);
+    *sum = lanes[0] + lanes[1] + tailSum;
+    _mm_storeu_si128((__m128i *) lanes, accSq);
+    *sumSq = lanes[0] + lanes[1] + tailSq;
 }
 
-void genHash(unsigned char *image, int width, int height, unsigned char **hash)
+// Bytes of R, G and B in each 16 byte third of 16 RGB pixels
+static const signed char lumaShuffle[3][3][16] =
 {
-    int y, x;
-    unsigned long int k, size;
-
-    size = (unsigned long int) width * height;
-
-    *hash = malloc(size);
-
-    k = 0;
-    for (y = 0; y < height; y++)
     {
-        for (x = 0; x < width; x++)
+        { 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+        { -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1 },
+        { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13 }
+    },
+    {
+        { 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+        { -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1 },
+        { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14 }
+    },
+    {
+        { 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+        { -1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1 },
+        { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15 }
+    }
+};
+
+/*
+    16 pixels at a time: the channels are gathered with byte shuffles and
+    weighted in pairs, R and G by 19595 and 19235, G and B by 19235 and
+    7471, so that G gets its 38470 without leaving signed 16 bits.
+*/
+__attribute__((target("avx2")))
+static void lumaAvx2(const unsigned char *rgb, unsigned char *gray, size_t n)
+{
+    const __m256i weightRG = _mm256_set1_epi32(19595 | (19235 << 16));
+    const __m256i weightGB = _mm256_set1_epi32(19235 | (7471 << 16));
+    const __m256i round = _mm256_set1_epi32(32768);
+    __m128i part[3], channel[3];
+    __m256i r, g, b, lo, hi;
+    size_t i;
+    int c, k;
+
+    for (i = 0; i + 16 <= n; i += 16, rgb += 48)
+    {
+        for (k = 0; k < 3; k++)
+            part[k] = _mm_loadu_si128((const __m128i *) (rgb + 16 * k));
+        for (c = 0; c < 3; c++)
         {
-            (*hash)[k] = image[k] < image[k + 1];
-            k++;
+            channel[c] = _mm_setzero_si128();
+            for (k = 0; k < 3; k++)
+                channel[c] = _mm_or_si128(channel[c], _mm_shuffle_epi8(part[k], _mm_loadu_si128((const __m128i *) lumaShuffle[c][k])));
         }
+
+        r = _mm256_cvtepu8_epi16(channel[0]);
+        g = _mm256_cvtepu8_epi16(channel[1]);
+        b = _mm256_cvtepu8_epi16(channel[2]);
+        lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(r, g), weightRG),
+                              _mm256_madd_epi16(_mm256_unpacklo_epi16(g, b), weightGB));
+        hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(r, g), weightRG),
+                              _mm256_madd_epi16(_mm256_unpackhi_epi16(g, b), weightGB));
+        lo = _mm256_srli_epi32(_mm256_add_epi32(lo, round), 16);
+        hi = _mm256_srli_epi32(_mm256_add_epi32(hi, round), 16);
+
+        // Unpacking and packing both stay within 128-bit lanes, so the
+        // pixels come back in order in the low 8 bytes of each lane
+        lo = _mm256_packus_epi16(_mm256_packs_epi32(lo, hi), _mm256_setzero_si256());
+        lo = _mm256_permute4x64_epi64(lo, 0x08);
+        _mm_storeu_si128((__m128i *) (gray + i), _mm256_castsi256_si128(lo));
     }
+
+    lumaScalar(rgb, gray + i, n - i);
 }
 
-int jpegHash(const char *filename, unsigned char **hash, int size)
+// Every CPU with AVX2 also has POPCNT, so it rides on that level
+__attribute__((target("popcnt")))
+static uint64_t hammingPopcnt(const uint64_t *a, const uint64_t *b, size_t words)
 {
-    unsigned char *image;
-    unsigned char *scaled;
-    int width, height;
-    unsigned long int imageSize = 0;
-
-    imageSize = decodeFile(filename, &image, FILETYPE_JPEG, &width, &height, JCS_GRAYSCALE);
-
-    if (!imageSize)
-        return 1;
+    uint64_t sum = 0;
+    size_t i;
 
-    scale(image, width, height, &scaled, size, size);
-    free(image);
-    genHash(scaled, size, size, hash);
-    free(scaled);
+    for (i = 0; i < words; i++)
+        sum += __builtin_popcountll(a[i] ^ b[i]);
 
-    return 0;
+    return sum;
 }
 
-int jpegHashFromBuffer(unsigned char *imageBuf, long bufSize, unsigned char **hash, int size)
+__attribute__((target("avx2")))
+static uint64_t sadAvx2(const unsigned char *a, const unsigned char *b, size_t n)
 {
-    unsigned char *image;
-    unsigned long imageSize = 0;
-    unsigned char *scaled;
-    int width, height, jpegcs;
-
-    imageSize = decodeFileFromBuffer(imageBuf, bufSize, &image, FILETYPE_JPEG, &width, &height, &jpegcs, JCS_GRAYSCALE);
-
-    if (!imageSize)
-        return 1;
+    __m256i acc = _mm256_setzero_si256();
+    uint64_t lanes[4];
+    size_t i;
 
-    scale(image, width, height, &scaled, size, size);
-    free(image);
-    genHash(scaled, size, size, hash);
-    free(scaled);
+    for (i = 0; i + 32 <= n; i += 32)
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *) (a + i)),
+                                                    _mm256_loadu_si256((const __m256i *) (b + i))));
 
-    return 0;
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sadScalar(a + i, b + i, n - i);
 }
 
-unsigned int hammingDist(const unsigned char *hash1, const unsigned char *hash2, int hashLength)
+__attribute__((target("avx2")))
+static uint64_t ssdAvx2(const unsigned char *a, const unsigned char *b, size_t n)
 {
-    unsigned int dist = 0, x;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero, lanes32, va, vb, d, lo, hi;
+    uint64_t lanes[4];
+    size_t i = 0, end;
 
-    for (x = 0; x < hashLength; x++)
+    while (n - i >= 32)
     {
-        if (hash1[x] != hash2[x])
+        lanes32 = zero;
+        end = i + MIN((n - i) / 32, KERNEL_FLUSH) * 32;
+        for (; i < end; i += 32)
         {
-            dist++;
+            va = _mm256_loadu_si256((const __m256i *) (a + i));
+            vb = _mm256_loadu_si256((const __m256i *) (b + i));
+            d = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+            lo = _mm256_unpacklo_epi8(d, zero);
+            hi = _mm256_unpackhi_epi8(d, zero);
+            lanes32 = _mm256_add_epi32(lanes32, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
         }
+        acc = _mm256_add_epi64(acc, _mm256_add_epi64(_mm256_unpacklo_epi32(lanes32, zero), _mm256_unpackhi_epi32(lanes32, zero)));
     }
 
-    return dist;
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + ssdScalar(a + i, b + i, n - i);
 }
 
-/* Print program version to stdout. */
-void version(void)
+__attribute__((target("avx2")))
+static void momentsAvx2(const unsigned char *a, const unsigned char *b, size_t n, uint64_t *sum, uint64_t *sumSq)
 {
-    printf("%s\n", JMVERSION);
-}
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i accSum = zero, accSq = zero, lanes32, va, vb, lo, hi;
+    uint64_t lanes[4], tailSum, tailSq;
+    size_t i = 0, end;
 
-/* Print an error message. */
-void error(const char *format, ...)
-{
-    va_list arglist;
+    while (n - i >= 32)
+    {
+        lanes32 = zero;
+        end = i + MIN((n - i) / 32, KERNEL_FLUSH) * 32;
+        for (; i < end; i += 32)
+        {
+            va = _mm256_loadu_si256((const __m256i *) (a + i));
+            vb = _mm256_loadu_si256((const __m256i *) (b + i));
+            accSum = _mm256_add_epi64(accSum, _mm256_add_epi64(_mm256_sad_epu8(va, zero), _mm256_sad_epu8(vb, zero)));
+            lo = _mm256_unpacklo_epi8(va, zero);
+            hi = _mm256_unpackhi_epi8(va, zero);
+            lanes32 = _mm256_add_epi32(lanes32, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+            lo = _mm256_unpacklo_epi8(vb, zero);
+            hi = _mm256_unpackhi_epi8(vb, zero);
+            lanes32 = _mm256_add_epi32(lanes32, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+        }
+        accSq = _mm256_add_epi64(accSq, _mm256_add_epi64(_mm256_unpacklo_epi32(lanes32, zero), _mm256_unpackhi_epi32(lanes32, zero)));
+    }
 
-    va_start(arglist, format);
-    fprintf(stderr, "%s: ", "ERROR");
-    vfprintf(stderr, format, arglist);
-    fputc('\n', stderr);
-    va_end(arglist);
+    momentsScalar(a + i, b + i, n - i, &tailSum, &tailSq);
+    _mm256_storeu_si256((__m256i *) lanes, accSum);
+    *sum = lanes[0] + lanes[1] + lanes[2] + lanes[3] + tailSum;
+    _mm256_storeu_si256((__m256i *) lanes, accSq);
+    *sumSq = lanes[0] + lanes[1] + lanes[2] + lanes[3] + tailSq;
 }
 
-unsigned long int readFile(char *name, void **buffer)
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t sadAvx512(const unsigned char *a, const unsigned char *b, size_t n)
 {
-    FILE *file;
-    unsigned long int fileLen = 0;
-    unsigned long int bytesRead = 0;
+    __m512i acc = _mm512_setzero_si512();
+    size_t i;
 
-    unsigned char chunk[INPUT_BUFFER_SIZE];
+    for (i = 0; i + 64 <= n; i += 64)
+        acc = _mm512_add_epi64(acc, _mm512_sad_epu8(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i)));
 
-    // Open file
-    if (strcmp("-", name) == 0)
-    {
-        file = stdin;
+    return _mm512_reduce_add_epi64(acc) + sadScalar(a + i, b + i, n - i);
+}
 
-#ifdef _WIN32
-        // We need to use binary mode on Windows otherwise we get
-        // corrupted files. See this issue:
-        // https://github.com/danielgtaylor/jpeg-archive/issues/14
-        setmode(fileno(stdin), O_BINARY);
-#endif
-    }
-    else
-    {
-        file = fopen(name, "rb");
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t ssdAvx512(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i acc = zero, lanes32, va, vb, d, lo, hi;
+    size_t i = 0, end;
 
-        if (!file)
+    while (n - i >= 64)
+    {
+        lanes32 = zero;
+        end = i + MIN((n - i) / 64, KERNEL_FLUSH) * 64;
+        for (; i < end; i += 64)
         {
-            error("unable to open file: %s", name);
-            return 0;
+            va = _mm512_loadu_si512(a + i);
+            vb = _mm512_loadu_si512(b + i);
+            d = _mm512_or_si512(_mm512_subs_epu8(va, vb), _mm512_subs_epu8(vb, va));
+            lo = _mm512_unpacklo_epi8(d, zero);
+            hi = _mm512_unpackhi_epi8(d, zero);
+            lanes32 = _mm512_add_epi32(lanes32, _mm512_add_epi32(_mm512_madd_epi16(lo, lo), _mm512_madd_epi16(hi, hi)));
         }
+        acc = _mm512_add_epi64(acc, _mm512_add_epi64(_mm512_unpacklo_epi32(lanes32, zero), _mm512_unpackhi_epi32(lanes32, zero)));
     }
 
-    *buffer = malloc(sizeof chunk);
+    return _mm512_reduce_add_epi64(acc) + ssdScalar(a + i, b + i, n - i);
+}
 
-    while ((bytesRead = fread(chunk, 1, sizeof chunk, file)) > 0)
-    {
-        unsigned char *reallocated = realloc(*buffer, fileLen + bytesRead);
+__attribute__((target("avx512f,avx512bw")))
+static void momentsAvx512(const unsigned char *a, const unsigned char *b, size_t n, uint64_t *sum, uint64_t *sumSq)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i accSum = zero, accSq = zero, lanes32, va, vb, lo, hi;
+    uint64_t tailSum, tailSq;
+    size_t i = 0, end;
 
-        if (reallocated)
-        {
-            *buffer = reallocated;
-            memmove((unsigned char *)(*buffer) + fileLen, chunk, bytesRead);
-            fileLen += bytesRead;
-        }
-        else
+    while (n - i >= 64)
+    {
+        lanes32 = zero;
+        end = i + MIN((n - i) / 64, KERNEL_FLUSH) * 64;
+        for (; i < end; i += 64)
         {
-            error("only able to read %zu bytes!", fileLen);
-            free(*buffer);
-            fclose(file);
-            return 0;
+            va = _mm512_loadu_si512(a + i);
+            vb = _mm512_loadu_si512(b + i);
+            accSum = _mm512_add_epi64(accSum, _mm512_add_epi64(_mm512_sad_epu8(va, zero), _mm512_sad_epu8(vb, zero)));
+            lo = _mm512_unpacklo_epi8(va, zero);
+            hi = _mm512_unpackhi_epi8(va, zero);
+            lanes32 = _mm512_add_epi32(lanes32, _mm512_add_epi32(_mm512_madd_epi16(lo, lo), _mm512_madd_epi16(hi, hi)));
+            lo = _mm512_unpacklo_epi8(vb, zero);
+            hi = _mm512_unpackhi_epi8(vb, zero);
+            lanes32 = _mm512_add_epi32(lanes32, _mm512_add_epi32(_mm512_madd_epi16(lo, lo), _mm512_madd_epi16(hi, hi)));
         }
+        accSq = _mm512_add_epi64(accSq, _mm512_add_epi64(_mm512_unpacklo_epi32(lanes32, zero), _mm512_unpackhi_epi32(lanes32, zero)));
     }
 
-    fclose(file);
-    return fileLen;
+    momentsScalar(a + i, b + i, n - i, &tailSum, &tailSq);
+    *sum = _mm512_reduce_add_epi64(accSum) + tailSum;
+    *sumSq = _mm512_reduce_add_epi64(accSq) + tailSq;
 }
+#endif
 
-int checkJpegMagic(const unsigned char *buf, unsigned long int size)
+// Kernels in use, picked once from the CPU features
+static struct
 {
-    return (size >= 2 && buf[0] == 0xff && buf[1] == 0xd8);
+    int level, detected;
+    uint64_t (*sad)(const unsigned char *a, const unsigned char *b, size_t n);
+    uint64_t (*ssd)(const unsigned char *a, const unsigned char *b, size_t n);
+    void (*moments)(const unsigned char *a, const unsigned char *b, size_t n, uint64_t *sum, uint64_t *sumSq);
+    void (*luma)(const unsigned char *rgb, unsigned char *gray, size_t n);
+    uint64_t (*hamming)(const uint64_t *a, const uint64_t *b, size_t words);
+} kernels;
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+
+static void useKernels(int level)
+{
+    kernels.level = level;
+    kernels.sad = sadScalar;
+    kernels.ssd = ssdScalar;
+    kernels.moments = momentsScalar;
+    kernels.luma = lumaScalar;
+    kernels.hamming = hammingScalar;
+
+#ifdef JM_X86_SIMD
+    // Gathering RGB needs byte shuffles, so luma has no SSE2 kernel
+    switch (level)
+    {
+    case SIMD_AVX512:
+        kernels.sad = sadAvx512;
+        kernels.ssd = ssdAvx512;
+        kernels.moments = momentsAvx512;
+        kernels.luma = lumaAvx2;
+        kernels.hamming = hammingPopcnt;
+        break;
+    case SIMD_AVX2:
+        kernels.sad = sadAvx2;
+        kernels.ssd = ssdAvx2;
+        kernels.moments = momentsAvx2;
+        kernels.luma = lumaAvx2;
+        kernels.hamming = hammingPopcnt;
+        break;
+    case SIMD_SSE2:
+        kernels.sad = sadSse2;
+        kernels.ssd = ssdSse2;
+        kernels.moments = momentsSse2;
+        break;
+    }
+#endif
 }
 
-unsigned long int decodeJpeg(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int *jpegcs, int pixelFormat)
+static void detectKernels(void)
 {
-    unsigned long int pixSize = 0;
-    int row = 0;
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    int row_stride;
-    JSAMPARRAY buffer;
+    kernels.detected = SIMD_SCALAR;
+
+#ifdef JM_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        kernels.detected = SIMD_AVX512;
+    else if (__builtin_cpu_supports("avx2"))
+        kernels.detected = SIMD_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        kernels.detected = SIMD_SSE2;
+#endif
 
-    cinfo.err = jpeg_std_error(&jerr);
+    useKernels(kernels.detected);
+}
 
-    jpeg_create_decompress(&cinfo);
+int simdLevel(void)
+{
+    pthread_once(&kernelsOnce, detectKernels);
+    return kernels.level;
+}
 
-    // Set the source
-    jpeg_mem_src(&cinfo, buf, bufSize);
+int simdSelect(int level)
+{
+    pthread_once(&kernelsOnce, detectKernels);
+    useKernels(clamp(SIMD_SCALAR, level, kernels.detected));
+    return kernels.level;
+}
 
-    // Read header and set custom parameters
-    jpeg_read_header(&cinfo, TRUE);
+// Kernel over one band of a buffer, run on a worker thread
+enum PIXEL_KERNEL
+{
+    KERNEL_SAD,
+    KERNEL_SSD,
+    KERNEL_MOMENTS
+};
 
-    cinfo.out_color_space = pixelFormat;
+typedef struct
+{
+    int kernel;
+    const unsigned char *a, *b;
+    size_t n;
+    uint64_t sum, sumSq;
+} pixel_band;
 
-    // Start decompression
-    jpeg_start_decompress(&cinfo);
+static void runPixelBand(void *arg)
+{
+    pixel_band *band = arg;
 
-    *width = cinfo.output_width;
-    *height = cinfo.output_height;
-    *jpegcs = cinfo.jpeg_color_space;
+    switch (band->kernel)
+    {
+    case KERNEL_SAD:
+        band->sum = kernels.sad(band->a, band->b, band->n);
+        break;
+    case KERNEL_SSD:
+        band->sum = kernels.ssd(band->a, band->b, band->n);
+        break;
+    case KERNEL_MOMENTS:
+        kernels.moments(band->a, band->b, band->n, &band->sum, &band->sumSq);
+        break;
+    }
+}
 
-    // Allocate temporary row
-    row_stride = (*width) * cinfo.output_components;
-    buffer = (*cinfo.mem->alloc_sarray)
-             ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
+/*
+    Run a kernel over bands of the buffers on the metric threads. The
+    band layout depends on n alone, and the partial sums are integers
+    added in band order, so the result is the same for any thread count.
+*/
+static void pixelBands(int kernel, const unsigned char *a, const unsigned char *b, size_t n, uint64_t *sum, uint64_t *sumSq)
+{
+    pixel_band bands[MAX_THREADS];
+    size_t bandSize, offset;
+    int count, i;
 
-    // Allocate image pixel buffer
-    *image = malloc(row_stride * (*height));
+    pthread_once(&kernelsOnce, detectKernels);
 
-    // Read image row by row
-    while (cinfo.output_scanline < cinfo.output_height)
+    count = (int) MIN((n + PIXEL_BAND - 1) / PIXEL_BAND, MAX_THREADS);
+    count = MAX(count, 1);
+    bandSize = ((n + count - 1) / count + 63) / 64 * 64;
+
+    for (i = 0, offset = 0; i < count; i++, offset += bandSize)
     {
-        (void) jpeg_read_scanlines(&cinfo, buffer, 1);
-        memcpy((void *)((*image) + row_stride * row), buffer[0], row_stride);
-        row++;
+        bands[i].kernel = kernel;
+        bands[i].a = a + MIN(offset, n);
+        bands[i].b = b + MIN(offset, n);
+        bands[i].n = (offset < n) ? MIN(bandSize, n - offset) : 0;
+        bands[i].sumSq = 0;
     }
 
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
-
-    pixSize = row_stride * (*height);
+    if (count == 1)
+        runPixelBand(&bands[0]);
+    else
+        parallelRun(runPixelBand, bands, sizeof(pixel_band), count, metricThreadCount());
 
-    return pixSize;
+    *sum = 0;
+    *sumSq = 0;
+    for (i = 0; i < count; i++)
+    {
+        *sum += bands[i].sum;
+        *sumSq += bands[i].sumSq;
+    }
 }
 
-unsigned long int encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int jpegcs, int progressive, int optimize, int subsample)
+uint64_t pixelSad(const unsigned char *a, const unsigned char *b, size_t n)
 {
-    unsigned long int jpegSize = 0;
+    uint64_t sum, unused;
+
+    pixelBands(KERNEL_SAD, a, b, n, &sum, &unused);
+    return sum;
+}
+
+uint64_t pixelSsd(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    uint64_t sum, unused;
+
+    pixelBands(KERNEL_SSD, a, b, n, &sum, &unused);
+    return sum;
+}
+
+void pixelMoments(const unsigned char *a, const unsigned char *b, size_t n, uint64_t *sum, uint64_t *sumSq)
+{
+    pixelBands(KERNEL_MOMENTS, a, b, n, sum, sumSq);
+}
+
+float metric_mpe(const unsigned char *original, const unsigned char *compressed, int width, int height, int components)
+{
+    size_t n = (size_t) width * height * components;
+
+    return (float) ((double) pixelSad(original, compressed, n) / n);
+}
+
+float metric_mse(const unsigned char *ref, const unsigned char *cmp, int width, int height, int channels)
+{
+    size_t n = (size_t) width * height * channels;
+
+    return (float) ((double) pixelSsd(ref, cmp, n) / n);
+}
+
+float metric_stdev2(const unsigned char *ref, const unsigned char *cmp, int width, int height, int channels)
+{
+    uint64_t sum, sumq;
+    double mean, stdev2;
+    size_t k, n;
+    int d;
+
+    n = (size_t) width * height;
+    stdev2 = 0.0;
+    for (d = 0; d < channels; d++)
+    {
+        if (channels == 1)
+        {
+            pixelMoments(ref, cmp, n, &sum, &sumq);
+        }
+        else
+        {
+            // Interleaved channels stay on the scalar path
+            sum = 0;
+            sumq = 0;
+            for (k = d; k < n * channels; k += channels)
+            {
+                sum += ref[k] + cmp[k];
+                sumq += ref[k] * ref[k] + cmp[k] * cmp[k];
+            }
+        }
+        mean = (double) sum / (2 * n);
+        stdev2 += (double) sumq / (2 * n) - mean * mean;
+    }
+    stdev2 /= channels;
+
+    return (float) stdev2;
+}
+
+float metric_msef(const unsigned char *ref, const unsigned char *cmp, int width, int height, int channels)
+{
+    float mse, stdev2;
+
+    mse = metric_mse(ref, cmp, width, height, channels);
+    stdev2 = metric_stdev2(ref, cmp, width, height, channels);
+    stdev2 = (stdev2 > 0.0f) ? stdev2 : 1.0f;
+    mse /= stdev2;
+    mse = sqrt(mse);
+
+    return mse;
+}
+
+int defishMapInit(defish_map *m, int width, int height, float strength, float zoom)
+{
+    const float len = sqrt(width * width + height * height);
+    float dx, dy, r;
+    int i, j;
+
+    m->width = width;
+    m->height = height;
+    m->strength = strength;
+    m->zoom = zoom;
+
+    // Pixels as far from the center as the center is from 0 reach
+    // every distance of the image
+    m->quadWidth = width / 2 + 1;
+    m->quadHeight = height / 2 + 1;
+    m->theta = malloc((unsigned long int) m->quadWidth * m->quadHeight * sizeof(float));
+    if (m->theta == NULL)
+        return 1;
+
+    for (j = 0; j < m->quadHeight; j++)
+    {
+        for (i = 0; i < m->quadWidth; i++)
+        {
+            dx = i * zoom;
+            dy = j * zoom;
+            r = sqrt(dx * dx + dy * dy) / len * strength;
+            m->theta[j * m->quadWidth + i] = (r != 0.0f) ? atan(r) / r : 1.0f;
+        }
+    }
+
+    return 0;
+}
+
+void defishMapFree(defish_map *m)
+{
+    free(m->theta);
+    m->theta = NULL;
+}
+
+// Rows of a defish, run on a worker thread
+typedef struct
+{
+    const defish_map *map;
+    const unsigned char *input;
+    unsigned char *output;
+    int components, first, last;
+} defish_rows;
+
+static void runDefishRows(void *arg)
+{
+    const defish_rows *rows = arg;
+    const defish_map *m = rows->map;
+    const int cx = m->width / 2;
+    const int cy = m->height / 2;
+    const int components = rows->components;
+    const int stride = m->width * components;
+    const unsigned char *p11, *p12, *p21, *p22;
+    const float *theta;
+    unsigned char *out;
+    float dx, dy, sx, sy, px, py, top, bot;
+    int x, y, z, x1, x2, y1, y2;
+
+    for (y = rows->first; y < rows->last; y++)
+    {
+        theta = m->theta + abs(cy - y) * m->quadWidth;
+        out = rows->output + (unsigned long int) y * stride;
+        dy = (cy - y) * m->zoom;
+
+        for (x = 0; x < m->width; x++)
+        {
+            dx = (cx - x) * m->zoom;
+            sx = clamp(0.0f, 0.5f * m->width - theta[abs(cx - x)] * dx, m->width);
+            sy = clamp(0.0f, 0.5f * m->height - theta[abs(cx - x)] * dy, m->height);
+
+            // interpolate() on the clamped corners; a coordinate on the
+            // far edge would otherwise read past the row or the image
+            x1 = floor(sx);
+            y1 = floor(sy);
+            px = sx - x1;
+            py = sy - y1;
+            x2 = MIN(ceil(sx), m->width - 1);
+            y2 = MIN(ceil(sy), m->height - 1);
+            x1 = MIN(x1, m->width - 1);
+            y1 = MIN(y1, m->height - 1);
+
+            p11 = rows->input + (unsigned long int) y1 * stride + x1 * components;
+            p12 = rows->input + (unsigned long int) y1 * stride + x2 * components;
+            p21 = rows->input + (unsigned long int) y2 * stride + x1 * components;
+            p22 = rows->input + (unsigned long int) y2 * stride + x2 * components;
+            for (z = 0; z < components; z++)
+            {
+                top = (float) p11[z] * (1.0f - px) + (float) p12[z] * px;
+                bot = (float) p21[z] * (1.0f - px) + (float) p22[z] * px;
+                *out++ = (top * (1.0 - py)) + (bot * py);
+            }
+        }
+    }
+}
+
+void defishMapped(const defish_map *m, const unsigned char *input, unsigned char *output, int components, int threads)
+{
+    defish_rows rows[MAX_THREADS];
+    int count, i;
+
+    count = MAX(1, MIN(MIN(threads, MAX_THREADS), m->height));
+    for (i = 0; i < count; i++)
+    {
+        rows[i].map = m;
+        rows[i].input = input;
+        rows[i].output = output;
+        rows[i].components = components;
+        rows[i].first = (int) ((long) m->height * i / count);
+        rows[i].last = (int) ((long) m->height * (i + 1) / count);
+    }
+
+    parallelRun(runDefishRows, rows, sizeof(defish_rows), count, count);
+}
+
+void defish(const unsigned char *input, unsigned char *output, int width, int height, int components, float strength, float zoom)
+{
+    defish_map map;
+
+    if (defishMapInit(&map, width, height, strength, zoom))
+        return;
+
+    defishMapped(&map, input, output, components, cpuCount());
+    defishMapFree(&map);
+}
+
+unsigned long int grayscale(const unsigned char *input, unsigned char **output, int width, int height)
+{
+    *output = malloc((unsigned long int) width * height);
+    if (*output == NULL)
+        return 0;
+
+    grayscaleInto(input, *output, width, height);
+
+    return (unsigned long int) width * height;
+}
+
+void grayscaleInto(const unsigned char *input, unsigned char *output, int width, int height)
+{
+    pthread_once(&kernelsOnce, detectKernels);
+    kernels.luma(input, output, (size_t) width * height);
+}
+
+void scale(unsigned char *image, int width, int height, unsigned char **newImage, int newWidth, int newHeight)
+{
+    int y, x, oldY, oldX;
+    unsigned long int k, size;
+
+    size = (unsigned long int) newWidth * newHeight;
+
+    *newImage = malloc(size);
+
+    k = 0;
+    for (y = 0; y < newHeight; y++)
+    {
+        for (x = 0; x < newWidth; x++)
+        {
+            oldY = (float) y / newHeight * height + 0.5f;
+            oldX = (float) x / newWidth * width + 0.5f;
+
+            (*newImage)[k] = image[oldY * width + oldX];
+            k++;
+
+        }
+    }
+}
+
+void areaScale(const unsigned char *image, int width, int height, unsigned char **newImage, int newWidth, int newHeight)
+{
+    unsigned long int *sums, count;
+    int *column, y, x, row;
+
+    *newImage = malloc((unsigned long int) newWidth * newHeight);
+    sums = calloc(newWidth, sizeof(unsigned long int));
+    column = malloc(width * sizeof(int));
+
+    // Each pixel goes to the one cell its index falls in, so every cell
+    // averages a whole rectangle and all pixels count once
+    for (x = 0; x < width; x++)
+        column[x] = (int) ((long) x * newWidth / width);
+
+    for (y = 0, row = 0; row < newHeight; row++)
+    {
+        for (; y < height && (long) y * newHeight / height == row; y++)
+            for (x = 0; x < width; x++)
+                sums[column[x]] += image[(unsigned long int) y * width + x];
+
+        for (x = 0; x < newWidth; x++)
+        {
+            count = (unsigned long int) (((long) (x + 1) * width + newWidth - 1) / newWidth - ((long) x * width + newWidth - 1) / newWidth) *
+                    (((long) (row + 1) * height + newHeight - 1) / newHeight - ((long) row * height + newHeight - 1) / newHeight);
+            (*newImage)[(unsigned long int) row * newWidth + x] = count ? (sums[x] + count / 2) / count : 0;
+            sums[x] = 0;
+        }
+    }
+
+    free(column);
+    free(sums);
+}
+
+unsigned long int downscale(const unsigned char *input, unsigned char **output, int width, int height, int components, int factor, int *newWidth, int *newHeight)
+{
+    int y, x, c, dy, dx, rows, cols;
+    unsigned long int k, sum;
+
+    *newWidth = (width + factor - 1) / factor;
+    *newHeight = (height + factor - 1) / factor;
+    *output = malloc((unsigned long int) *newWidth * *newHeight * components);
+
+    k = 0;
+    for (y = 0; y < *newHeight; y++)
+    {
+        rows = MIN(factor, height - y * factor);
+        for (x = 0; x < *newWidth; x++)
+        {
+            cols = MIN(factor, width - x * factor);
+            for (c = 0; c < components; c++)
+            {
+                sum = 0;
+                for (dy = 0; dy < rows; dy++)
+                    for (dx = 0; dx < cols; dx++)
+                        sum += input[((unsigned long int) (y * factor + dy) * width + x * factor + dx) * components + c];
+
+                (*output)[k++] = (sum + rows * cols / 2) / (rows * cols);
+            }
+        }
+    }
+
+    return (unsigned long int) *newWidth * *newHeight;
+}
+
+// Tile classes for sampling: luma variance below which a tile is flat,
+// and mean luma gradient above which it is dominated by edges
+#define SAMPLE_FLAT_VARIANCE 16.0f
+#define SAMPLE_EDGE_GRADIENT 8.0f
+
+unsigned long int sampleTiles(const unsigned char *input, const unsigned char *gray, int width, int height, int tile, int percent, unsigned char **output, int *newWidth, int *newHeight)
+{
+    int cols = width / tile, rows = height / tile, total = cols * rows;
+    int classCount[3] = { 0 }, take[3], seen[3] = { 0 }, next[3] = { 0 };
+    int *picked, count, i, t, c, x, y, tx, ty, sx, sy, sampleCols, sampleRows;
+    char *tileClass;
+    const unsigned char *p;
+    double sum, sumSq, gradient, n, mean, variance;
+
+    if (total == 0)
+        return 0;
+
+    // Classify tiles by the variance and mean gradient of their luma
+    tileClass = malloc(total);
+    n = (double) tile * tile;
+    for (t = 0; t < total; t++)
+    {
+        tx = (t % cols) * tile;
+        ty = (t / cols) * tile;
+        sum = sumSq = gradient = 0.0;
+        for (y = 0; y < tile; y++)
+        {
+            p = gray + (unsigned long int) (ty + y) * width + tx;
+            for (x = 0; x < tile; x++)
+            {
+                sum += p[x];
+                sumSq += p[x] * p[x];
+                if (x + 1 < tile)
+                    gradient += abs(p[x + 1] - p[x]);
+                if (y + 1 < tile)
+                    gradient += abs(p[x + width] - p[x]);
+            }
+        }
+        mean = sum / n;
+        variance = sumSq / n - mean * mean;
+        gradient /= n;
+
+        c = (variance < SAMPLE_FLAT_VARIANCE) ? 0 : ((gradient >= SAMPLE_EDGE_GRADIENT) ? 2 : 1);
+        tileClass[t] = c;
+        classCount[c]++;
+    }
+
+    // Stratified pick, at least one tile from every class present
+    count = 0;
+    for (c = 0; c < 3; c++)
+    {
+        take[c] = classCount[c] ? MAX(1, (int) ((long) classCount[c] * percent / 100)) : 0;
+        count += take[c];
+    }
+
+    // Spread the picks of each class evenly over its tiles in raster order
+    picked = malloc(count * sizeof(int));
+    i = 0;
+    for (t = 0; t < total && i < count; t++)
+    {
+        c = tileClass[t];
+        if (next[c] < take[c] && seen[c] == (int) ((next[c] + 0.5) * classCount[c] / take[c]))
+        {
+            picked[i++] = t;
+            next[c]++;
+        }
+        seen[c]++;
+    }
+    count = i;
+
+    // Pack into a near square grid, repeating picks to fill the last row
+    sampleCols = (int) ceil(sqrt(count));
+    sampleRows = (count + sampleCols - 1) / sampleCols;
+    *newWidth = sampleCols * tile;
+    *newHeight = sampleRows * tile;
+    *output = malloc((unsigned long int) *newWidth * *newHeight * 3);
+
+    for (i = 0; i < sampleCols * sampleRows; i++)
+    {
+        t = picked[i % count];
+        tx = (t % cols) * tile;
+        ty = (t / cols) * tile;
+        sx = (i % sampleCols) * tile;
+        sy = (i / sampleCols) * tile;
+        for (y = 0; y < tile; y++)
+            memcpy(*output + ((unsigned long int) (sy + y) * *newWidth + sx) * 3,
+                   input + ((unsigned long int) (ty + y) * width + tx) * 3, tile * 3);
+    }
+
+    free(picked);
+    free(tileClass);
+
+    return (unsigned long int) *newWidth * *newHeight;
+}
+
+void genHash(const unsigned char *image, int width, int height, uint64_t **hash)
+{
+    const unsigned char *row;
+    int y, x;
+    unsigned long int k;
+
+    *hash = calloc(HASH_WORDS((unsigned long int) width * height), sizeof(uint64_t));
+
+    k = 0;
+    for (y = 0; y < height; y++)
+    {
+        row = image + (unsigned long int) y * width;
+        for (x = 0; x < width; x++, k++)
+        {
+            // The last pixel of a row wraps around to its first
+            if (row[x] < row[(x + 1 < width) ? x + 1 : 0])
+                (*hash)[k / 64] |= (uint64_t) 1 << (k % 64);
+        }
+    }
+}
+
+int jpegHash(const char *filename, uint64_t **hash, int size)
+{
+    unsigned char *buf = NULL;
+    unsigned long int bufSize;
+    int ret;
+
+    bufSize = readFile((char *) filename, (void **) &buf);
+    if (!bufSize)
+        return 1;
+
+    ret = jpegHashFromBuffer(buf, bufSize, hash, size);
+    free(buf);
+
+    return ret;
+}
+
+// An error manager that returns to decodeJpegReduced instead of exiting
+typedef struct
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} reduced_error_mgr;
+
+static void reducedErrorExit(j_common_ptr cinfo)
+{
+    reduced_error_mgr *err = (reduced_error_mgr *) cinfo->err;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(err->jump, 1);
+}
+
+/*
+    Decode the luma at the smallest DCT scaling that still keeps minSize
+    pixels on each side. At 1/8 each block is reduced to its DC, so most
+    of the inverse DCT and all of the upsampling are skipped, and a
+    progressive file is only read up to the end of the scan that
+    completes the luma DC. Progressive scripts often send the DC with
+    its low bit left for a refinement scan (libjpeg's own uses Al=1),
+    so the first scan alone is not enough. A corrupt file only fails
+    its own decode and returns 0, as jpeg-dupes hashes whole trees.
+*/
+static unsigned long int decodeJpegReduced(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int minSize)
+{
+    struct jpeg_decompress_struct cinfo;
+    reduced_error_mgr jerr;
+    JSAMPROW row;
+    int dcOnly, ret;
+
+    *image = NULL;
+    if (!checkJpegMagic(buf, bufSize))
+        return 0;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = reducedErrorExit;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        free(*image);
+        *image = NULL;
+        return 0;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, buf, bufSize);
+    jpeg_read_header(&cinfo, TRUE);
+
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    cinfo.scale_num = 1;
+    for (cinfo.scale_denom = 8; cinfo.scale_denom > 1; cinfo.scale_denom /= 2)
+    {
+        jpeg_calc_output_dimensions(&cinfo);
+        if ((int) cinfo.output_width >= minSize && (int) cinfo.output_height >= minSize)
+            break;
+    }
+
+    // Sequential files may have several scans too, but each holds whole
+    // blocks and libjpeg keeps no coef_bits for them
+    dcOnly = cinfo.scale_denom == 8 && cinfo.progressive_mode;
+    cinfo.buffered_image = dcOnly;
+
+    jpeg_start_decompress(&cinfo);
+    if (dcOnly)
+    {
+        // The bits of a scan are known once it starts, its data once it ends
+        for (;;)
+        {
+            ret = jpeg_consume_input(&cinfo);
+            if (ret == JPEG_SUSPENDED || ret == JPEG_REACHED_EOI)
+                break;
+            if (ret == JPEG_SCAN_COMPLETED && cinfo.coef_bits[0][0] == 0)
+                break;
+        }
+        jpeg_start_output(&cinfo, cinfo.input_scan_number);
+    }
+
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    *image = malloc((unsigned long int) (*width) * (*height));
+
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        row = *image + (unsigned long int) cinfo.output_scanline * (*width);
+        (void) jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    // The rest of the scans only refine the AC, which 1/8 does not show
+    if (dcOnly)
+    {
+        jpeg_finish_output(&cinfo);
+        jpeg_abort_decompress(&cinfo);
+    }
+    else
+    {
+        jpeg_finish_decompress(&cinfo);
+    }
+    jpeg_destroy_decompress(&cinfo);
+
+    return (unsigned long int) (*width) * (*height);
+}
+
+int jpegHashFromBuffer(unsigned char *imageBuf, long bufSize, uint64_t **hash, int size)
+{
+    unsigned char *image;
+    unsigned long imageSize = 0;
+    unsigned char *scaled;
+    int width, height;
+
+    imageSize = decodeJpegReduced(imageBuf, bufSize, &image, &width, &height, size);
+
+    if (!imageSize)
+        return 1;
+
+    if (width >= size && height >= size)
+        areaScale(image, width, height, &scaled, size, size);
+    else
+        scale(image, width, height, &scaled, size, size);
+    free(image);
+    genHash(scaled, size, size, hash);
+    free(scaled);
+
+    return 0;
+}
+
+unsigned int hammingDist(const uint64_t *hash1, const uint64_t *hash2, int hashLength)
+{
+    pthread_once(&kernelsOnce, detectKernels);
+    return (unsigned int) kernels.hamming(hash1, hash2, HASH_WORDS(hashLength));
+}
+
+// Saved indexes start with this, then the hash length and entry count
+#define HASH_INDEX_MAGIC "JMHINDX1"
+
+// Tables have about eight buckets for every entry, as the fewer there
+// are in each the fewer are compared, but no fewer than 256 or more
+// than 1M buckets
+#define HASH_PART_MIN 8
+#define HASH_PART_MAX 20
+
+void hashIndexInit(hash_index *idx, int bits)
+{
+    memset(idx, 0, sizeof(hash_index));
+    idx->bits = bits;
+    idx->words = HASH_WORDS(bits);
+}
+
+void hashIndexFree(hash_index *idx)
+{
+    free(idx->hashes);
+    free(idx->firsts);
+    free(idx->offsets);
+    free(idx->entries);
+    memset(idx, 0, sizeof(hash_index));
+}
+
+int hashIndexAdd(hash_index *idx, const uint64_t *hash)
+{
+    if (idx->count == idx->capacity)
+    {
+        idx->capacity = MAX(64, idx->capacity * 2);
+        idx->hashes = realloc(idx->hashes, (size_t) idx->capacity * idx->words * sizeof(uint64_t));
+    }
+
+    memcpy(idx->hashes + (size_t) idx->count * idx->words, hash, idx->words * sizeof(uint64_t));
+
+    return idx->count++;
+}
+
+static uint32_t hashPartKey(const hash_index *idx, const uint64_t *hash, int part)
+{
+    int first = idx->firsts[part], length = idx->firsts[part + 1] - first;
+    uint64_t key;
+
+    key = hash[first / 64] >> (first % 64);
+    if (first % 64 + length > 64)
+        key |= hash[first / 64 + 1] << (64 - first % 64);
+
+    return (uint32_t) (key & (((uint64_t) 1 << length) - 1));
+}
+
+void hashIndexBuild(hash_index *idx)
+{
+    int part, length, x, *offsets, *entries;
+    size_t tableSize = 0;
+    uint32_t key;
+
+    free(idx->firsts);
+    free(idx->offsets);
+    free(idx->entries);
+
+    // The parts split the hash as evenly as its length allows
+    for (length = HASH_PART_MIN; length < HASH_PART_MAX && ((long) 1 << length) < 8L * idx->count; length++);
+    idx->parts = (idx->bits + length - 1) / length;
+    idx->firsts = malloc((idx->parts + 1) * sizeof(int));
+
+    for (part = 0; part <= idx->parts; part++)
+        idx->firsts[part] = (int) ((long) part * idx->bits / idx->parts);
+    for (part = 0; part < idx->parts; part++)
+        tableSize += ((size_t) 1 << (idx->firsts[part + 1] - idx->firsts[part])) + 1;
+
+    idx->offsets = calloc(tableSize, sizeof(int));
+    idx->entries = malloc(MAX((size_t) idx->count * idx->parts, 1) * sizeof(int));
+
+    // Each table lists the entries by the key of one part, with the
+    // start of every key's run in offsets, as in a counting sort
+    offsets = idx->offsets;
+    entries = idx->entries;
+    for (part = 0; part < idx->parts; part++)
+    {
+        length = idx->firsts[part + 1] - idx->firsts[part];
+
+        for (x = 0; x < idx->count; x++)
+            offsets[hashPartKey(idx, idx->hashes + (size_t) x * idx->words, part) + 1]++;
+        for (key = 0; key < (uint32_t) 1 << length; key++)
+            offsets[key + 1] += offsets[key];
+        for (x = 0; x < idx->count; x++)
+            entries[offsets[hashPartKey(idx, idx->hashes + (size_t) x * idx->words, part)]++] = x;
+
+        // Filling moved every start up to the next one
+        memmove(offsets + 1, offsets, ((size_t) 1 << length) * sizeof(int));
+        offsets[0] = 0;
+
+        offsets += ((size_t) 1 << length) + 1;
+        entries += idx->count;
+    }
+
+    idx->built = idx->count;
+}
+
+static int compareInt(const void *a, const void *b)
+{
+    return (*(const int *) a > *(const int *) b) - (*(const int *) a < *(const int *) b);
+}
+
+// Matches of one query, gathered as the tables are searched
+typedef struct
+{
+    const hash_index *idx;
+    const uint64_t *hash;
+    const int *offsets, *entries;
+    int part, length, radius, partRadius, count;
+    uint32_t *keys;
+    int *matches;
+} hash_query;
+
+/*
+    An entry within radius of the query has some part within
+    partRadius of the query's, so it is found in the first table where
+    that holds and skipped in any later one.
+*/
+static void hashQueryBucket(hash_query *q, uint32_t key)
+{
+    const uint64_t *hash;
+    int x, id, part;
+
+    for (x = q->offsets[key]; x < q->offsets[key + 1]; x++)
+    {
+        id = q->entries[x];
+        hash = q->idx->hashes + (size_t) id * q->idx->words;
+
+        for (part = 0; part < q->part; part++)
+        {
+            if (__builtin_popcount(hashPartKey(q->idx, hash, part) ^ q->keys[part]) <= q->partRadius)
+                break;
+        }
+
+        if (part == q->part && (int) hammingDist(hash, q->hash, q->idx->bits) <= q->radius)
+            q->matches[q->count++] = id;
+    }
+}
+
+// Every key with flips more bits of key flipped, from bit first up
+static void hashQueryFlips(hash_query *q, uint32_t key, int first, int flips)
+{
+    int b;
+
+    hashQueryBucket(q, key);
+
+    if (flips)
+    {
+        for (b = first; b < q->length; b++)
+            hashQueryFlips(q, key ^ ((uint32_t) 1 << b), b + 1, flips - 1);
+    }
+}
+
+int hashIndexQuery(const hash_index *idx, const uint64_t *hash, int radius, int **matches)
+{
+    hash_query q;
+    double probes = 0, choose;
+    int k, x;
+
+    q.idx = idx;
+    q.hash = hash;
+    q.radius = radius;
+    q.partRadius = radius / MAX(idx->parts, 1);
+    q.count = 0;
+    q.matches = malloc(MAX(idx->count, 1) * sizeof(int));
+
+    // Buckets to look in, C(length, 0) + ... + C(length, partRadius)
+    // per table, against comparing with every entry
+    for (q.part = 0; q.part < idx->parts; q.part++)
+    {
+        q.length = idx->firsts[q.part + 1] - idx->firsts[q.part];
+        for (k = 0, choose = 1; k <= q.partRadius && k <= q.length; k++)
+        {
+            probes += choose;
+            choose = choose * (q.length - k) / (k + 1);
+        }
+    }
+
+    if (idx->built != idx->count || probes >= idx->count)
+    {
+        for (x = 0; x < idx->count; x++)
+        {
+            if ((int) hammingDist(idx->hashes + (size_t) x * idx->words, hash, idx->bits) <= radius)
+                q.matches[q.count++] = x;
+        }
+    }
+    else
+    {
+        q.keys = malloc(idx->parts * sizeof(uint32_t));
+        for (q.part = 0; q.part < idx->parts; q.part++)
+            q.keys[q.part] = hashPartKey(idx, hash, q.part);
+
+        q.offsets = idx->offsets;
+        q.entries = idx->entries;
+        for (q.part = 0; q.part < idx->parts; q.part++)
+        {
+            q.length = idx->firsts[q.part + 1] - idx->firsts[q.part];
+            hashQueryFlips(&q, q.keys[q.part], 0, MIN(q.partRadius, q.length));
+            q.offsets += ((size_t) 1 << q.length) + 1;
+            q.entries += idx->count;
+        }
+
+        free(q.keys);
+        qsort(q.matches, q.count, sizeof(int), compareInt);
+    }
+
+    *matches = q.matches;
+
+    return q.count;
+}
+
+static void putWord(FILE *file, uint64_t value, int bytes)
+{
+    int b;
+
+    for (b = 0; b < bytes; b++)
+        fputc((int) (value >> (8 * b) & 0xff), file);
+}
+
+static int getWord(FILE *file, uint64_t *value, int bytes)
+{
+    int b, c;
+
+    *value = 0;
+    for (b = 0; b < bytes; b++)
+    {
+        if ((c = fgetc(file)) == EOF)
+            return 1;
+        *value |= (uint64_t) c << (8 * b);
+    }
+
+    return 0;
+}
+
+int hashIndexSave(const hash_index *idx, FILE *file)
+{
+    size_t x;
+
+    fwrite(HASH_INDEX_MAGIC, 1, 8, file);
+    putWord(file, idx->bits, 4);
+    putWord(file, idx->count, 4);
+
+    // Little endian words, so the file is the same on any host
+    for (x = 0; x < (size_t) idx->count * idx->words; x++)
+        putWord(file, idx->hashes[x], 8);
+
+    return ferror(file) ? 1 : 0;
+}
+
+int hashIndexLoad(hash_index *idx, FILE *file)
+{
+    char magic[8];
+    uint64_t bits, count, *hash;
+    int id, x, bad = 0;
+
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, HASH_INDEX_MAGIC, 8) ||
+        getWord(file, &bits, 4) || getWord(file, &count, 4) ||
+        bits < 1 || bits > INT32_MAX - 63 || count > INT32_MAX)
+        return 1;
+
+    hashIndexInit(idx, (int) bits);
+    hash = malloc(idx->words * sizeof(uint64_t));
+
+    for (id = 0; id < (int) count && !bad; id++)
+    {
+        for (x = 0; x < idx->words && !bad; x++)
+            bad = getWord(file, &hash[x], 8);
+        if (!bad)
+            hashIndexAdd(idx, hash);
+    }
+
+    free(hash);
+
+    if (bad)
+        hashIndexFree(idx);
+    else
+        hashIndexBuild(idx);
+
+    return bad;
+}
+
+typedef struct
+{
+    parallel_job job;
+    char *args;
+    size_t argSize;
+    int first, count, step;
+} parallel_slice;
+
+static void *parallelWorker(void *arg)
+{
+    parallel_slice *slice = arg;
+    int i;
+
+    for (i = slice->first; i < slice->count; i += slice->step)
+        slice->job(slice->args + i * slice->argSize);
+
+    return NULL;
+}
+
+void parallelRun(parallel_job job, void *args, size_t argSize, int count, int threads)
+{
+    pthread_t tid[MAX_THREADS];
+    parallel_slice slice[MAX_THREADS];
+    int started[MAX_THREADS];
+    int t;
+
+    threads = MIN(threads, MIN(count, MAX_THREADS));
+    if (threads < 1)
+        threads = 1;
+
+    for (t = 0; t < threads; t++)
+    {
+        slice[t].job = job;
+        slice[t].args = args;
+        slice[t].argSize = argSize;
+        slice[t].first = t;
+        slice[t].count = count;
+        slice[t].step = threads;
+        started[t] = 0;
+    }
+
+    // Worker 0 is the calling thread; a worker that fails to start
+    // has its slice run by the caller as well.
+    for (t = 1; t < threads; t++)
+        started[t] = !pthread_create(&tid[t], NULL, parallelWorker, &slice[t]);
+
+    parallelWorker(&slice[0]);
+
+    for (t = 1; t < threads; t++)
+    {
+        if (started[t])
+            pthread_join(tid[t], NULL);
+        else
+            parallelWorker(&slice[t]);
+    }
+}
+
+int cpuCount(void)
+{
+    long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    return (n > 0) ? (int)MIN(n, MAX_THREADS) : 1;
+}
+
+/* Print program version to stdout. */
+void version(void)
+{
+    printf("%s\n", JMVERSION);
+}
+
+/* Print an error message. */
+void error(const char *format, ...)
+{
+    va_list arglist;
+
+    va_start(arglist, format);
+    fprintf(stderr, "%s: ", "ERROR");
+    vfprintf(stderr, format, arglist);
+    fputc('\n', stderr);
+    va_end(arglist);
+}
+
+unsigned long int readFile(char *name, void **buffer)
+{
+    FILE *file;
+    unsigned long int fileLen = 0;
+    unsigned long int bytesRead = 0;
+
+    unsigned char chunk[INPUT_BUFFER_SIZE];
+
+    // Open file
+    if (strcmp("-", name) == 0)
+    {
+        file = stdin;
+
+#ifdef _WIN32
+        // We need to use binary mode on Windows otherwise we get
+        // corrupted files. See this issue:
+        // https://github.com/danielgtaylor/jpeg-archive/issues/14
+        setmode(fileno(stdin), O_BINARY);
+#endif
+    }
+    else
+    {
+        file = fopen(name, "rb");
+
+        if (!file)
+        {
+            error("unable to open file: %s", name);
+            return 0;
+        }
+    }
+
+    *buffer = malloc(sizeof chunk);
+
+    while ((bytesRead = fread(chunk, 1, sizeof chunk, file)) > 0)
+    {
+        unsigned char *reallocated = realloc(*buffer, fileLen + bytesRead);
+
+        if (reallocated)
+        {
+            *buffer = reallocated;
+            memmove((unsigned char *)(*buffer) + fileLen, chunk, bytesRead);
+            fileLen += bytesRead;
+        }
+        else
+        {
+            error("only able to read %zu bytes!", fileLen);
+            free(*buffer);
+            fclose(file);
+            return 0;
+        }
+    }
+
+    fclose(file);
+    return fileLen;
+}
+
+int checkJpegMagic(const unsigned char *buf, unsigned long int size)
+{
+    return (size >= 2 && buf[0] == 0xff && buf[1] == 0xd8);
+}
+
+unsigned long int decodeJpeg(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int *jpegcs, int pixelFormat)
+{
+    unsigned long int pixSize = 0;
+    int row = 0;
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    int row_stride;
+    JSAMPARRAY buffer;
+
+    cinfo.err = jpeg_std_error(&jerr);
+
+    jpeg_create_decompress(&cinfo);
+
+    // Set the source
+    jpeg_mem_src(&cinfo, buf, bufSize);
+
+    // Read header and set custom parameters
+    jpeg_read_header(&cinfo, TRUE);
+
+    cinfo.out_color_space = pixelFormat;
+
+    // Start decompression
+    jpeg_start_decompress(&cinfo);
+
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    *jpegcs = cinfo.jpeg_color_space;
+
+    // Allocate temporary row
+    row_stride = (*width) * cinfo.output_components;
+    buffer = (*cinfo.mem->alloc_sarray)
+             ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
+
+    // Allocate image pixel buffer
+    *image = malloc(row_stride * (*height));
+
+    // Read image row by row
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        (void) jpeg_read_scanlines(&cinfo, buffer, 1);
+        memcpy((void *)((*image) + row_stride * row), buffer[0], row_stride);
+        row++;
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    pixSize = row_stride * (*height);
+
+    return pixSize;
+}
+
+/*
+    Decode to the luma of the file and, if image is given, to RGB. YCbCr
+    and grayscale files keep the decoder's own Y samples, and RGB comes
+    from upsampled YCbCr through the tables of jdcolor.c, which gives
+    the same pixels as asking libjpeg for RGB. Other color spaces are
+    decoded to RGB and each row converted while it is in cache.
+*/
+static unsigned long int decodeJpegLuma(unsigned char *buf, unsigned long bufSize, unsigned char **image, unsigned char **gray, int *width, int *height, int *jpegcs)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPARRAY buffer;
+    const unsigned char *in;
+    unsigned char *out, *luma;
+    int crR[256], cbB[256], crG[256], cbG[256];
+    int native, row, x, i, y, cb, cr;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, buf, bufSize);
+    jpeg_read_header(&cinfo, TRUE);
+
+    native = (cinfo.jpeg_color_space == JCS_YCbCr || cinfo.jpeg_color_space == JCS_GRAYSCALE);
+    if (!native)
+        cinfo.out_color_space = JCS_RGB;
+    else if (image && cinfo.jpeg_color_space == JCS_YCbCr)
+        cinfo.out_color_space = JCS_YCbCr;
+    else
+        cinfo.out_color_space = JCS_GRAYSCALE;
+
+    jpeg_start_decompress(&cinfo);
+
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    *jpegcs = cinfo.jpeg_color_space;
+
+    buffer = (*cinfo.mem->alloc_sarray)
+             ((j_common_ptr) &cinfo, JPOOL_IMAGE, (*width) * cinfo.output_components, 1);
+    if (image)
+        *image = malloc((unsigned long int) (*width) * (*height) * 3);
+    *gray = malloc((unsigned long int) (*width) * (*height));
+    pthread_once(&kernelsOnce, detectKernels);
+
+    for (i = 0; i < 256; i++)
+    {
+        x = i - CENTERJSAMPLE;
+        crR[i] = (91881 * x + 32768) >> 16;
+        cbB[i] = (116130 * x + 32768) >> 16;
+        crG[i] = -46802 * x;
+        cbG[i] = -22554 * x + 32768;
+    }
+
+    for (row = 0; cinfo.output_scanline < cinfo.output_height; row++)
+    {
+        (void) jpeg_read_scanlines(&cinfo, buffer, 1);
+        in = buffer[0];
+        luma = *gray + (unsigned long int) (*width) * row;
+        out = image ? *image + (unsigned long int) (*width) * row * 3 : NULL;
+
+        if (!native)
+        {
+            if (out)
+                memcpy(out, in, (unsigned long int) (*width) * 3);
+            kernels.luma(in, luma, *width);
+        }
+        else if (cinfo.out_color_space == JCS_YCbCr)
+        {
+            for (x = 0; x < *width; x++, in += 3, out += 3)
+            {
+                y = in[0];
+                cb = in[1];
+                cr = in[2];
+                luma[x] = y;
+                out[0] = clamp(0, y + crR[cr], 255);
+                out[1] = clamp(0, y + ((cbG[cb] + crG[cr]) >> 16), 255);
+                out[2] = clamp(0, y + cbB[cb], 255);
+            }
+        }
+        else
+        {
+            memcpy(luma, in, *width);
+            for (x = 0; out && x < *width; x++, out += 3)
+                out[0] = out[1] = out[2] = in[x];
+        }
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    return (unsigned long int) (*width) * (*height) * (image ? 3 : 1);
+}
+
+/*
+    Set up the compression parameters shared by the scanline and planar
+    encoders. The destination must already be set.
+*/
+static void setupCompress(struct jpeg_compress_struct *cinfo, int width, int height, int pixelFormat, int quality, int jpegcs, int progressive, int optimize, int subsample)
+{
+    // Set options
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = pixelFormat == JCS_RGB ? 3 : 1;
+    cinfo->in_color_space = pixelFormat;
+
+    /*
+    // Mozjpeg:
+        if (!optimize)
+        {
+            // Not optimizing for space, so use a much faster compression
+            // profile. This is about twice as fast and can be used when
+            // testing visual quality *before* doing the final encoding.
+            // Note: This *must* be set before calling `jpeg_set_defaults`
+            // as it modifies how that call works.
+            if (jpeg_c_int_param_supported(cinfo, JINT_COMPRESS_PROFILE))
+                jpeg_c_set_int_param(cinfo, JINT_COMPRESS_PROFILE, JCP_FASTEST);
+        }
+    */
+
+    jpeg_set_defaults(cinfo);
+
+    /*
+    // Mozjpeg:
+        if (!optimize)
+        {
+            // Disable trellis quantization if we aren't optimizing. This saves
+            // a little processing.
+            if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_TRELLIS_QUANT))
+                jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT, FALSE);
+            if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_TRELLIS_QUANT_DC))
+                jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT_DC, FALSE);
+        }
+    */
+
+    if (optimize)
+        cinfo->optimize_coding = TRUE;
+
+    if (optimize && !progressive)
+    {
+        cinfo->scan_info = NULL;
+        cinfo->num_scans = 0;
+        /*
+        // Mozjpeg:
+                // Moz defaults, disable progressive
+                if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_OPTIMIZE_SCANS))
+                    jpeg_c_set_bool_param(cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+        */
+    }
+
+    if (!optimize && progressive)
+    {
+        // No moz defaults, set scan progression
+        jpeg_simple_progression(cinfo);
+    }
+
+    jpeg_set_quality(cinfo, quality, TRUE);
+    jpeg_set_colorspace (cinfo, jpegcs);
+
+    if (subsample == SUBSAMPLE_444)
+    {
+        cinfo->comp_info[0].h_samp_factor = 1;
+        cinfo->comp_info[0].v_samp_factor = 1;
+        cinfo->comp_info[1].h_samp_factor = 1;
+        cinfo->comp_info[1].v_samp_factor = 1;
+        cinfo->comp_info[2].h_samp_factor = 1;
+        cinfo->comp_info[2].v_samp_factor = 1;
+    }
+    else if (subsample == SUBSAMPLE_422)
+    {
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = 1;
+    }
+}
+
+unsigned long int encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int jpegcs, int progressive, int optimize, int subsample)
+{
+    unsigned long int jpegSize = 0;
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     JSAMPROW row_pointer[1];
     int row_stride = width * (pixelFormat == JCS_RGB ? 3 : 1);
 
-    cinfo.err = jpeg_std_error(&jerr);
+    cinfo.err = jpeg_std_error(&jerr);
+
+    jpeg_create_compress(&cinfo);
+
+    // Set destination
+    jpeg_mem_dest(&cinfo, jpeg, &jpegSize);
+
+    setupCompress(&cinfo, width, height, pixelFormat, quality, jpegcs, progressive, optimize, subsample);
+
+    // Start the compression
+    jpeg_start_compress(&cinfo, TRUE);
+
+    // Process scanlines one by one
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        row_pointer[0] = &buf[cinfo.next_scanline * row_stride];
+        (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return jpegSize;
+}
+
+// Copy the last of rows rows of a plane down to its full height
+static void planeFillBottom(unsigned char *plane, int width, int rows, int height)
+{
+    int y;
+
+    for (y = rows; y < height; y++)
+        memcpy(plane + (unsigned long int) y * width, plane + (unsigned long int) (rows - 1) * width, width);
+}
+
+// Fixed-point RGB to YCbCr of jccolor.c: FIX(x), ONE_HALF and CBCR_OFFSET
+#define YCC_ROUND 32768
+#define YCC_OFFSET (128 << 16)
+
+int planesInit(jpeg_planes *p, const unsigned char *rgb, int width, int height, int jpegcs, int subsample)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *full[3] = { NULL, NULL, NULL };
+    const unsigned char *px;
+    int c, x, y, fx, fy, dx, dy, mx, my, bias, sum, groupHeight, rows;
+    unsigned long int k, size;
+
+    if (jpegcs != JCS_YCbCr && jpegcs != JCS_GRAYSCALE && jpegcs != JCS_RGB)
+        return 1;
+
+    // Let libjpeg pick the sampling, exactly as encodeJpeg would
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    setupCompress(&cinfo, width, height, JCS_RGB, 75, jpegcs, 0, 0, subsample);
+
+    p->width = width;
+    p->height = height;
+    p->jpegcs = jpegcs;
+    p->subsample = subsample;
+    p->components = cinfo.num_components;
+    p->maxHSamp = p->maxVSamp = 1;
+    for (c = 0; c < p->components; c++)
+    {
+        p->hSamp[c] = cinfo.comp_info[c].h_samp_factor;
+        p->vSamp[c] = cinfo.comp_info[c].v_samp_factor;
+        p->maxHSamp = MAX(p->maxHSamp, p->hSamp[c]);
+        p->maxVSamp = MAX(p->maxVSamp, p->vSamp[c]);
+    }
+    jpeg_destroy_compress(&cinfo);
+
+    // Whole MCUs at full resolution, edges replicated like libjpeg does:
+    // columns and the last row group before downsampling, the remaining
+    // rows by copying the last downsampled row (jcprepct.c)
+    mx = p->maxHSamp * DCTSIZE;
+    my = p->maxVSamp * DCTSIZE;
+    p->paddedWidth = (width + mx - 1) / mx * mx;
+    p->paddedHeight = (height + my - 1) / my * my;
+    groupHeight = (height + p->maxVSamp - 1) / p->maxVSamp * p->maxVSamp;
+    size = (unsigned long int) p->paddedWidth * p->paddedHeight;
+
+    for (c = 0; c < p->components; c++)
+        full[c] = malloc(size);
+
+    k = 0;
+    for (y = 0; y < groupHeight; y++)
+    {
+        for (x = 0; x < p->paddedWidth; x++, k++)
+        {
+            px = rgb + ((unsigned long int) MIN(y, height - 1) * width + MIN(x, width - 1)) * 3;
+
+            if (jpegcs == JCS_RGB)
+            {
+                full[0][k] = px[0];
+                full[1][k] = px[1];
+                full[2][k] = px[2];
+                continue;
+            }
+
+            full[0][k] = (19595 * px[0] + 38470 * px[1] + 7471 * px[2] + YCC_ROUND) >> 16;
+            if (jpegcs == JCS_YCbCr)
+            {
+                full[1][k] = (-11059 * px[0] - 21709 * px[1] + 32768 * px[2] + YCC_OFFSET + YCC_ROUND - 1) >> 16;
+                full[2][k] = (32768 * px[0] - 27439 * px[1] - 5329 * px[2] + YCC_OFFSET + YCC_ROUND - 1) >> 16;
+            }
+        }
+    }
+
+    // Downsample with the rounding of jcsample.c
+    for (c = 0; c < p->components; c++)
+    {
+        fx = p->maxHSamp / p->hSamp[c];
+        fy = p->maxVSamp / p->vSamp[c];
+        p->planeWidth[c] = p->paddedWidth / fx;
+        p->planeHeight[c] = p->paddedHeight / fy;
+        rows = groupHeight / fy;
+
+        if (fx == 1 && fy == 1)
+        {
+            p->plane[c] = full[c];
+            planeFillBottom(p->plane[c], p->planeWidth[c], rows, p->planeHeight[c]);
+            continue;
+        }
+
+        p->plane[c] = malloc((unsigned long int) p->planeWidth[c] * p->planeHeight[c]);
+        k = 0;
+        for (y = 0; y < rows; y++)
+        {
+            // h2v1 alternates a bias of 0, 1 and h2v2 one of 1, 2
+            bias = (fy == 2) ? 1 : 0;
+            for (x = 0; x < p->planeWidth[c]; x++, k++)
+            {
+                sum = 0;
+                for (dy = 0; dy < fy; dy++)
+                    for (dx = 0; dx < fx; dx++)
+                        sum += full[c][(unsigned long int) (y * fy + dy) * p->paddedWidth + x * fx + dx];
+
+                if (fx == 2 && fy <= 2)
+                {
+                    p->plane[c][k] = (sum + bias) >> (fy == 2 ? 2 : 1);
+                    bias ^= (fy == 2) ? 3 : 1;
+                }
+                else
+                {
+                    p->plane[c][k] = (sum + fx * fy / 2) / (fx * fy);
+                }
+            }
+        }
+        planeFillBottom(p->plane[c], p->planeWidth[c], rows, p->planeHeight[c]);
+        free(full[c]);
+    }
+
+    return 0;
+}
+
+void planesFree(jpeg_planes *p)
+{
+    int c;
+
+    for (c = 0; c < p->components; c++)
+        free(p->plane[c]);
+}
+
+unsigned long int encodeJpegPlanes(unsigned char **jpeg, const jpeg_planes *p, int quality, int progressive, int optimize, int lumaOnly)
+{
+    unsigned long int jpegSize = 0;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW rows[3][MAX_SAMP_FACTOR * DCTSIZE];
+    JSAMPARRAY data[3];
+    int c, r, y, components, lines;
+
+    lumaOnly = lumaOnly && p->jpegcs != JCS_RGB;
+    components = lumaOnly ? 1 : p->components;
+
+    cinfo.err = jpeg_std_error(&jerr);
+
+    jpeg_create_compress(&cinfo);
+
+    // Set destination
+    jpeg_mem_dest(&cinfo, jpeg, &jpegSize);
+
+    if (lumaOnly)
+        setupCompress(&cinfo, p->width, p->height, JCS_GRAYSCALE, quality, JCS_GRAYSCALE, progressive, optimize, p->subsample);
+    else
+        setupCompress(&cinfo, p->width, p->height, JCS_RGB, quality, p->jpegcs, progressive, optimize, p->subsample);
+
+    // The planes are already converted and downsampled
+    cinfo.raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    // Scaled DCTs would read full resolution chroma rows as raw data
+    cinfo.do_fancy_downsampling = FALSE;
+#endif
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    // One iMCU row per call
+    lines = cinfo.max_v_samp_factor * DCTSIZE;
+    for (c = 0; c < components; c++)
+        data[c] = rows[c];
+
+    for (y = 0; cinfo.next_scanline < cinfo.image_height; y++)
+    {
+        for (c = 0; c < components; c++)
+        {
+            for (r = 0; r < cinfo.comp_info[c].v_samp_factor * DCTSIZE; r++)
+                rows[c][r] = p->plane[c] + ((unsigned long int) y * cinfo.comp_info[c].v_samp_factor * DCTSIZE + r) * p->planeWidth[c];
+        }
+        (void) jpeg_write_raw_data(&cinfo, data, lines);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return jpegSize;
+}
+
+int transcoderInit(jpeg_transcoder *tc, unsigned char *buf, unsigned long int bufSize)
+{
+    tc->cinfo.err = jpeg_std_error(&tc->jerr);
+
+    jpeg_create_decompress(&tc->cinfo);
+
+    // Read the source coefficients once, they stay in memory
+    jpeg_mem_src(&tc->cinfo, buf, bufSize);
+    jpeg_read_header(&tc->cinfo, TRUE);
+    tc->coefs = jpeg_read_coefficients(&tc->cinfo);
+
+    if (tc->coefs == NULL)
+    {
+        jpeg_destroy_decompress(&tc->cinfo);
+        return 1;
+    }
+
+    return 0;
+}
+
+void transcoderFree(jpeg_transcoder *tc)
+{
+    jpeg_finish_decompress(&tc->cinfo);
+    jpeg_destroy_decompress(&tc->cinfo);
+}
+
+/*
+    Requantize a row of blocks from the source table to the destination
+    table, rounding half away from zero like the forward quantizer. The
+    division uses a 40-bit reciprocal, exact for any dequantized value
+    below 2^24, so the loop has no branches and no divisions.
+*/
+static void requantizeRow(JBLOCKROW src, JBLOCKROW dst, JDIMENSION count, const JQUANT_TBL *srcQ, const JQUANT_TBL *dstQ)
+{
+    uint64_t recip[DCTSIZE2];
+    int32_t mult[DCTSIZE2], half[DCTSIZE2];
+    int32_t value, sign;
+    JDIMENSION blockX;
+    int k;
+
+    for (k = 0; k < DCTSIZE2; k++)
+    {
+        mult[k] = srcQ->quantval[k];
+        half[k] = dstQ->quantval[k] / 2;
+        recip[k] = (((uint64_t) 1 << 40) + dstQ->quantval[k] - 1) / dstQ->quantval[k];
+    }
+
+    for (blockX = 0; blockX < count; blockX++)
+    {
+        for (k = 0; k < DCTSIZE2; k++)
+        {
+            value = src[blockX][k] * mult[k];
+            sign = value >> 31;
+            value = MIN((value ^ sign) - sign, (1 << 24) - 1 - half[k]);
+            value = (int32_t) (((uint64_t) (value + half[k]) * recip[k]) >> 40);
+            dst[blockX][k] = (value ^ sign) - sign;
+        }
+    }
+}
+
+unsigned long int transcodeJpeg(jpeg_transcoder *tc, unsigned char **jpeg, int quality, int progressive, int optimize, int lumaOnly)
+{
+    unsigned long int jpegSize = 0;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    jvirt_barray_ptr *coefs;
+    jpeg_component_info *comp;
+    JQUANT_TBL *srcQ, *dstQ;
+    JBLOCKARRAY srcRows, dstRows;
+    UINT16 stdQ[2][DCTSIZE2];
+    int used[NUM_QUANT_TBLS] = { 0 };
+    int c, n, k, row, rows, blockY, lumaTable, components;
+
+    cinfo.err = jpeg_std_error(&jerr);
+
+    jpeg_create_compress(&cinfo);
+
+    // Set destination
+    jpeg_mem_dest(&cinfo, jpeg, &jpegSize);
+
+    // Same geometry, sampling and color space as the source
+    jpeg_copy_critical_parameters(&tc->cinfo, &cinfo);
+
+    // Luma keeps its blocks, and the tables below, as a single component
+    components = tc->cinfo.num_components;
+    if (lumaOnly)
+    {
+        jpeg_set_colorspace(&cinfo, JCS_GRAYSCALE);
+        components = 1;
+    }
+
+    // Standard luma and chroma tables at the trial quality
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    memcpy(stdQ[0], cinfo.quant_tbl_ptrs[0]->quantval, sizeof(stdQ[0]));
+    memcpy(stdQ[1], cinfo.quant_tbl_ptrs[1]->quantval, sizeof(stdQ[1]));
+
+    // Never quantize finer than the source did
+    lumaTable = tc->cinfo.comp_info[0].quant_tbl_no;
+    for (c = 0; c < components; c++)
+    {
+        n = tc->cinfo.comp_info[c].quant_tbl_no;
+        if (used[n]++)
+            continue;
+
+        srcQ = tc->cinfo.quant_tbl_ptrs[n];
+        if (cinfo.quant_tbl_ptrs[cinfo.comp_info[c].quant_tbl_no] == NULL)
+            cinfo.quant_tbl_ptrs[cinfo.comp_info[c].quant_tbl_no] = jpeg_alloc_quant_table((j_common_ptr) &cinfo);
+        dstQ = cinfo.quant_tbl_ptrs[cinfo.comp_info[c].quant_tbl_no];
+
+        for (k = 0; k < DCTSIZE2; k++)
+            dstQ->quantval[k] = MAX(stdQ[n == lumaTable ? 0 : 1][k], srcQ->quantval[k]);
+        dstQ->sent_table = FALSE;
+    }
+
+    if (optimize)
+        cinfo.optimize_coding = TRUE;
+
+    if (progressive)
+        jpeg_simple_progression(&cinfo);
+
+    // Destination coefficient arrays, realized by jpeg_write_coefficients
+    coefs = (jvirt_barray_ptr *) (*cinfo.mem->alloc_small)
+            ((j_common_ptr) &cinfo, JPOOL_IMAGE, sizeof(jvirt_barray_ptr) * components);
+    for (c = 0; c < components; c++)
+    {
+        // Padded to whole iMCU rows, like the source arrays
+        comp = tc->cinfo.comp_info + c;
+        rows = (comp->height_in_blocks + comp->v_samp_factor - 1) / comp->v_samp_factor * comp->v_samp_factor;
+        coefs[c] = (*cinfo.mem->request_virt_barray)
+                   ((j_common_ptr) &cinfo, JPOOL_IMAGE, FALSE, comp->width_in_blocks, rows, comp->v_samp_factor);
+    }
+
+    jpeg_write_coefficients(&cinfo, coefs);
+
+    // Requantize. The source arrays are only read, so several trials
+    // may share one transcoder.
+    for (c = 0; c < components; c++)
+    {
+        comp = tc->cinfo.comp_info + c;
+        srcQ = comp->quant_table;
+        dstQ = cinfo.quant_tbl_ptrs[cinfo.comp_info[c].quant_tbl_no];
+
+        for (blockY = 0; blockY < comp->height_in_blocks; blockY += comp->v_samp_factor)
+        {
+            srcRows = (*tc->cinfo.mem->access_virt_barray)
+                      ((j_common_ptr) &tc->cinfo, tc->coefs[c], blockY, comp->v_samp_factor, FALSE);
+            dstRows = (*cinfo.mem->access_virt_barray)
+                      ((j_common_ptr) &cinfo, coefs[c], blockY, comp->v_samp_factor, TRUE);
+
+            for (row = 0; row < comp->v_samp_factor && blockY + row < comp->height_in_blocks; row++)
+            {
+                if (!memcmp(srcQ->quantval, dstQ->quantval, sizeof(srcQ->quantval)))
+                    memcpy(dstRows[row], srcRows[row], comp->width_in_blocks * sizeof(JBLOCK));
+                else
+                    requantizeRow(srcRows[row], dstRows[row], comp->width_in_blocks, srcQ, dstQ);
+            }
+        }
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return jpegSize;
+}
+
+int checkPpmMagic(const unsigned char *buf, unsigned long int size)
+{
+    return (size >= 2 && buf[0] == 'P' && buf[1] == '6');
+}
+
+unsigned long int decodePpm(unsigned char *buf, unsigned long int bufSize, unsigned char **image, int *width, int *height)
+{
+    unsigned long int ppmSize = 0;
+    unsigned long int pos = 0, imageDataSize;
+    int depth;
+
+    if (!checkPpmMagic(buf, bufSize))
+    {
+        error("not a valid PPM format image!");
+        return 0;
+    }
+
+    // Read to first newline
+    while (buf[pos++] != '\n' && pos < bufSize);
+
+    // Discard for any comment and empty lines
+    while ((buf[pos] == '#' || buf[pos] == '\n') && pos < bufSize)
+    {
+        while (buf[pos] != '\n')
+        {
+            pos++;
+        }
+        pos++;
+    }
+
+    if (pos >= bufSize)
+    {
+        error("not a valid PPM format image!");
+        return 0;
+    }
 
-    jpeg_create_compress(&cinfo);
+    // Read width/height
+    sscanf((const char *) buf + pos, "%d %d", width, height);
 
-    // Set destination
-    jpeg_mem_dest(&cinfo, jpeg, &jpegSize);
+    // Go to next line
+    while (buf[pos++] != '\n' && pos < bufSize);
 
-    // Set options
-    cinfo.image_width = width;
-    cinfo.image_height = height;
-    cinfo.input_components = pixelFormat == JCS_RGB ? 3 : 1;
-    cinfo.in_color_space = pixelFormat;
+    if (pos >= bufSize)
+    {
+        error("not a valid PPM format image!");
+        return 0;
+    }
 
-    /*
-    // Mozjpeg:
-        if (!optimize)
+    // Read bit depth
+    sscanf((const char*) buf + pos, "%d", &depth);
+
+    if (depth != 255)
+    {
+        error("unsupported bit depth: %d", depth);
+        return 0;
+    }
+
+    // Go to next line
+    while (buf[pos++] != '\n' && pos < bufSize);
+
+    // Width * height * red/green/blue
+    imageDataSize = (*width) * (*height) * 3;
+    if (pos + imageDataSize != bufSize)
+    {
+        error("incorrect image size: %lu vs. %lu", bufSize, pos + imageDataSize);
+        return 0;
+    }
+
+    // Allocate image pixel buffer
+    *image = malloc(imageDataSize);
+
+    // Copy pixel data
+    memcpy((void *) *image, (void *) buf + pos, imageDataSize);
+
+    ppmSize = (*width) * (*height);
+
+    return ppmSize;
+}
+
+enum filetype detectFiletype(const char *filename)
+{
+    unsigned char *buf = NULL;
+    long bufSize = 0;
+    bufSize = readFile((char *)filename, (void **)&buf);
+    enum filetype ret = detectFiletypeFromBuffer(buf, bufSize);
+    free(buf);
+    return ret;
+}
+
+enum filetype detectFiletypeFromBuffer(unsigned char *buf, unsigned long int bufSize)
+{
+    if (checkJpegMagic(buf, bufSize))
+        return FILETYPE_JPEG;
+
+    if (checkPpmMagic(buf, bufSize))
+        return FILETYPE_PPM;
+
+    return FILETYPE_UNKNOWN;
+}
+
+unsigned long int decodeFile(const char *filename, unsigned char **image, enum filetype type, int *width, int *height, int pixelFormat)
+{
+    unsigned char *buf = NULL;
+    int jpegcs;
+    unsigned long int bufSize = 0;
+    bufSize = readFile((char *)filename, (void **)&buf);
+    unsigned long int ret = decodeFileFromBuffer(buf, bufSize, image, type, width, height, &jpegcs, pixelFormat);
+    free(buf);
+    return ret;
+}
+
+unsigned long int decodeFileFromBuffer(unsigned char *buf, unsigned long int bufSize, unsigned char **image, enum filetype type, int *width, int *height, int *jpegcs, int pixelFormat)
+{
+    switch (type)
+    {
+    case FILETYPE_PPM:
+        *jpegcs = JCS_RGB;
+        return decodePpm(buf, bufSize, image, width, height);
+    case FILETYPE_JPEG:
+        return decodeJpeg(buf, bufSize, image, width, height, jpegcs, pixelFormat);
+    default:
+        return 0;
+    }
+}
+
+unsigned long int decodeFileFromBufferGray(unsigned char *buf, unsigned long int bufSize, unsigned char **image, unsigned char **gray, enum filetype type, int *width, int *height, int *jpegcs)
+{
+    unsigned char *rgb;
+    unsigned long int size;
+
+    switch (type)
+    {
+    case FILETYPE_PPM:
+        *jpegcs = JCS_RGB;
+        size = decodePpm(buf, bufSize, &rgb, width, height);
+        if (size && !grayscale(rgb, gray, *width, *height))
         {
-            // Not optimizing for space, so use a much faster compression
-            // profile. This is about twice as fast and can be used when
-            // testing visual quality *before* doing the final encoding.
-            // Note: This *must* be set before calling `jpeg_set_defaults`
-            // as it modifies how that call works.
-            if (jpeg_c_int_param_supported(&cinfo, JINT_COMPRESS_PROFILE))
-                jpeg_c_set_int_param(&cinfo, JINT_COMPRESS_PROFILE, JCP_FASTEST);
+            free(rgb);
+            return 0;
         }
-    */
+        if (size && image)
+            *image = rgb;
+        else if (size)
+            free(rgb);
+        return size;
+    case FILETYPE_JPEG:
+        return decodeJpegLuma(buf, bufSize, image, gray, width, height, jpegcs);
+    default:
+        return 0;
+    }
+}
 
-    jpeg_set_defaults(&cinfo);
+int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **meta, unsigned int *metaSize, const char *comment)
+{
+    unsigned int pos = 0;
+    unsigned int totalSize = 0;
+    unsigned int offsets[20];
+    unsigned int sizes[20];
+    unsigned int count = 0;
+    unsigned int marker;
+    int size, x;
 
-    /*
-    // Mozjpeg:
-        if (!optimize)
+    // Read through all the file markers
+    while (pos < bufSize && count < 20)
+    {
+        marker = (buf[pos] << 8) + buf[pos + 1];
+
+        //printf("Marker %x at %u\n", marker, pos);
+
+        if (marker == 0xffda /* SOS */)
         {
-            // Disable trellis quantization if we aren't optimizing. This saves
-            // a little processing.
-            if (jpeg_c_bool_param_supported(&cinfo, JBOOLEAN_TRELLIS_QUANT))
-                jpeg_c_set_bool_param(&cinfo, JBOOLEAN_TRELLIS_QUANT, FALSE);
-            if (jpeg_c_bool_param_supported(&cinfo, JBOOLEAN_TRELLIS_QUANT_DC))
-                jpeg_c_set_bool_param(&cinfo, JBOOLEAN_TRELLIS_QUANT_DC, FALSE);
+            // This is the end, so stop!
+            break;
+        }
+        else if (marker == 0xffdd /* DRI */)
+        {
+            pos += 2 + 4;
+        }
+        else if (marker >= 0xffd0 && marker <= 0xffd9 /* RST0+x */)
+        {
+            pos += 2;
+        }
+        else
+        {
+            // Marker has a custom size, read it in
+            size = (buf[pos + 2] << 8) + buf[pos + 3];
+            //printf("Size is %i (%x)\n", size, size);
+
+            // Save APP0+x and COM markers
+            if ((marker >= 0xffe1 && marker <= 0xffef) || marker == 0xfffe)
+            {
+                if (marker == 0xfffe && comment != NULL && !strncmp(comment, (char *) buf + pos + 4, strlen(comment)))
+                {
+                    return 1;
+                }
+
+                totalSize += size + 2;
+                offsets[count] = pos;
+                sizes[count] = size + 2;
+                count++;
+            }
+
+            pos += 2 + size;
+        }
+    }
+
+    // Allocate the metadata buffer
+    *meta = malloc(totalSize);
+    *metaSize = totalSize;
+
+    // Copy over all the metadata into the new buffer
+    pos = 0;
+    for (x = 0; x < count; x++)
+    {
+        memcpy(((*meta) + pos), (buf + offsets[x]), sizes[x]);
+        pos += sizes[x];
+    }
+
+    return 0;
+}
+
+// Annex K tables in natural order, as scaled by jpeg_set_quality
+static const unsigned int stdLumaQuant[DCTSIZE2] =
+{
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+static const unsigned int stdChromaQuant[DCTSIZE2] =
+{
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99
+};
+
+// Natural position of the k-th coefficient in zigzag order
+static const int zigzagOrder[DCTSIZE2] =
+{
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+int estimateJpegQuality(const unsigned int *quant, int chroma)
+{
+    const unsigned int *base = chroma ? stdChromaQuant : stdLumaQuant;
+    unsigned long int dist, bestDist = (unsigned long int) -1;
+    long int value;
+    int quality, scale, k, best = 0;
+
+    for (quality = 1; quality <= 100; quality++)
+    {
+        scale = jpeg_quality_scaling(quality);
+        dist = 0;
+        for (k = 0; k < DCTSIZE2; k++)
+        {
+            value = ((long int) base[k] * scale + 50) / 100;
+            value = (value < 1) ? 1 : ((value > 255) ? 255 : value);
+            dist += labs(value - (long int) quant[k]);
+        }
+        if (dist < bestDist)
+        {
+            bestDist = dist;
+            best = quality;
+        }
+    }
+
+    return best;
+}
+
+// Integer DCTs of jfdctint.c and jidctint.c: 13 fraction bits in the
+// constants and 2 extra bits of precision between the passes
+#define DCT_CONST_BITS 13
+#define DCT_PASS1_BITS 2
+#define DCT_DESCALE(x, n) (((x) + ((int32_t) 1 << ((n) - 1))) >> (n))
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+// Markers of a baseline grayscale JFIF file around its two Huffman
+// tables: SOI, APP0, DQT, SOF0, SOS and EOI, then DHT without symbols
+#define GRAY_JPEG_OVERHEAD 114
+#define DHT_OVERHEAD 21
+
+/*
+    Forward DCT of one block of centered samples, in place. The output is
+    scaled up by 8, like libjpeg's.
+*/
+static void fdctIslow(int32_t *data)
+{
+    int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    int32_t tmp10, tmp11, tmp12, tmp13, z1, z2, z3, z4, z5;
+    int32_t *p;
+    int i, step, shift, bits;
+
+    // Rows first, then columns with the extra precision removed
+    for (i = 0; i < 2 * DCTSIZE; i++)
+    {
+        p = (i < DCTSIZE) ? data + i * DCTSIZE : data + i - DCTSIZE;
+        step = (i < DCTSIZE) ? 1 : DCTSIZE;
+        bits = (i < DCTSIZE) ? DCT_CONST_BITS - DCT_PASS1_BITS : DCT_CONST_BITS + DCT_PASS1_BITS;
+        shift = (i < DCTSIZE) ? 0 : DCT_PASS1_BITS;
+
+        tmp0 = p[0] + p[7 * step];
+        tmp7 = p[0] - p[7 * step];
+        tmp1 = p[step] + p[6 * step];
+        tmp6 = p[step] - p[6 * step];
+        tmp2 = p[2 * step] + p[5 * step];
+        tmp5 = p[2 * step] - p[5 * step];
+        tmp3 = p[3 * step] + p[4 * step];
+        tmp4 = p[3 * step] - p[4 * step];
+
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        if (shift)
+        {
+            p[0] = DCT_DESCALE(tmp10 + tmp11, shift);
+            p[4 * step] = DCT_DESCALE(tmp10 - tmp11, shift);
+        }
+        else
+        {
+            p[0] = (tmp10 + tmp11) * (1 << DCT_PASS1_BITS);
+            p[4 * step] = (tmp10 - tmp11) * (1 << DCT_PASS1_BITS);
+        }
+
+        z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        p[2 * step] = DCT_DESCALE(z1 + tmp13 * FIX_0_765366865, bits);
+        p[6 * step] = DCT_DESCALE(z1 - tmp12 * FIX_1_847759065, bits);
+
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 = z3 * -FIX_1_961570560 + z5;
+        z4 = z4 * -FIX_0_390180644 + z5;
+
+        p[7 * step] = DCT_DESCALE(tmp4 + z1 + z3, bits);
+        p[5 * step] = DCT_DESCALE(tmp5 + z2 + z4, bits);
+        p[3 * step] = DCT_DESCALE(tmp6 + z2 + z3, bits);
+        p[step] = DCT_DESCALE(tmp7 + z1 + z4, bits);
+    }
+}
+
+/*
+    Inverse DCT of one quantized block with its quantization table, into
+    8 rows of stride bytes. Output goes through the 1024 entry range
+    limit table libjpeg wraps and clamps with. All-zero columns and rows
+    take libjpeg's shortcuts, which give the same result as the full
+    transform.
+*/
+static void idctIslow(const JCOEF *coef, const int *quant, const unsigned char *limit, unsigned char *out, int stride)
+{
+    int32_t tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13, z1, z2, z3, z4, z5;
+    int32_t work[DCTSIZE2];
+    const JCOEF *in;
+    const int *q;
+    int32_t *w;
+    int i;
+
+    // Columns of dequantized coefficients into work
+    for (i = 0; i < DCTSIZE; i++)
+    {
+        in = coef + i;
+        q = quant + i;
+        w = work + i;
+
+        if (!(in[8] | in[16] | in[24] | in[32] | in[40] | in[48] | in[56]))
+        {
+            w[0] = w[8] = w[16] = w[24] = w[32] = w[40] = w[48] = w[56] = in[0] * q[0] * (1 << DCT_PASS1_BITS);
+            continue;
+        }
+
+        z2 = in[16] * q[16];
+        z3 = in[48] * q[48];
+        z1 = (z2 + z3) * FIX_0_541196100;
+        tmp2 = z1 - z3 * FIX_1_847759065;
+        tmp3 = z1 + z2 * FIX_0_765366865;
+        z2 = in[0] * q[0];
+        z3 = in[32] * q[32];
+        tmp0 = (z2 + z3) * (1 << DCT_CONST_BITS);
+        tmp1 = (z2 - z3) * (1 << DCT_CONST_BITS);
+
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        tmp0 = in[56] * q[56];
+        tmp1 = in[40] * q[40];
+        tmp2 = in[24] * q[24];
+        tmp3 = in[8] * q[8];
+
+        z1 = tmp0 + tmp3;
+        z2 = tmp1 + tmp2;
+        z3 = tmp0 + tmp2;
+        z4 = tmp1 + tmp3;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp0 *= FIX_0_298631336;
+        tmp1 *= FIX_2_053119869;
+        tmp2 *= FIX_3_072711026;
+        tmp3 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 = z3 * -FIX_1_961570560 + z5;
+        z4 = z4 * -FIX_0_390180644 + z5;
+
+        tmp0 += z1 + z3;
+        tmp1 += z2 + z4;
+        tmp2 += z2 + z3;
+        tmp3 += z1 + z4;
+
+        w[0] = DCT_DESCALE(tmp10 + tmp3, DCT_CONST_BITS - DCT_PASS1_BITS);
+        w[56] = DCT_DESCALE(tmp10 - tmp3, DCT_CONST_BITS - DCT_PASS1_BITS);
+        w[8] = DCT_DESCALE(tmp11 + tmp2, DCT_CONST_BITS - DCT_PASS1_BITS);
+        w[48] = DCT_DESCALE(tmp11 - tmp2, DCT_CONST_BITS - DCT_PASS1_BITS);
+        w[16] = DCT_DESCALE(tmp12 + tmp1, DCT_CONST_BITS - DCT_PASS1_BITS);
+        w[40] = DCT_DESCALE(tmp12 - tmp1, DCT_CONST_BITS - DCT_PASS1_BITS);
+        w[24] = DCT_DESCALE(tmp13 + tmp0, DCT_CONST_BITS - DCT_PASS1_BITS);
+        w[32] = DCT_DESCALE(tmp13 - tmp0, DCT_CONST_BITS - DCT_PASS1_BITS);
+    }
+
+    // Rows of work into the output, without the extra precision and the
+    // scale of 8
+    for (i = 0; i < DCTSIZE; i++, out += stride)
+    {
+        w = work + i * DCTSIZE;
+
+        if (!(w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]))
+        {
+            memset(out, limit[DCT_DESCALE(w[0], DCT_PASS1_BITS + 3) & 1023], DCTSIZE);
+            continue;
+        }
+
+        z2 = w[2];
+        z3 = w[6];
+        z1 = (z2 + z3) * FIX_0_541196100;
+        tmp2 = z1 - z3 * FIX_1_847759065;
+        tmp3 = z1 + z2 * FIX_0_765366865;
+        tmp0 = (w[0] + w[4]) * (1 << DCT_CONST_BITS);
+        tmp1 = (w[0] - w[4]) * (1 << DCT_CONST_BITS);
+
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        tmp0 = w[7];
+        tmp1 = w[5];
+        tmp2 = w[3];
+        tmp3 = w[1];
+
+        z1 = tmp0 + tmp3;
+        z2 = tmp1 + tmp2;
+        z3 = tmp0 + tmp2;
+        z4 = tmp1 + tmp3;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp0 *= FIX_0_298631336;
+        tmp1 *= FIX_2_053119869;
+        tmp2 *= FIX_3_072711026;
+        tmp3 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 = z3 * -FIX_1_961570560 + z5;
+        z4 = z4 * -FIX_0_390180644 + z5;
+
+        tmp0 += z1 + z3;
+        tmp1 += z2 + z4;
+        tmp2 += z2 + z3;
+        tmp3 += z1 + z4;
+
+        out[0] = limit[DCT_DESCALE(tmp10 + tmp3, DCT_CONST_BITS + DCT_PASS1_BITS + 3) & 1023];
+        out[7] = limit[DCT_DESCALE(tmp10 - tmp3, DCT_CONST_BITS + DCT_PASS1_BITS + 3) & 1023];
+        out[1] = limit[DCT_DESCALE(tmp11 + tmp2, DCT_CONST_BITS + DCT_PASS1_BITS + 3) & 1023];
+        out[6] = limit[DCT_DESCALE(tmp11 - tmp2, DCT_CONST_BITS + DCT_PASS1_BITS + 3) & 1023];
+        out[2] = limit[DCT_DESCALE(tmp12 + tmp1, DCT_CONST_BITS + DCT_PASS1_BITS + 3) & 1023];
+        out[5] = limit[DCT_DESCALE(tmp12 - tmp1, DCT_CONST_BITS + DCT_PASS1_BITS + 3) & 1023];
+        out[3] = limit[DCT_DESCALE(tmp13 + tmp0, DCT_CONST_BITS + DCT_PASS1_BITS + 3) & 1023];
+        out[4] = limit[DCT_DESCALE(tmp13 - tmp0, DCT_CONST_BITS + DCT_PASS1_BITS + 3) & 1023];
+    }
+}
+
+// Bits needed for a magnitude, its JPEG size category
+static int magnitudeBits(unsigned int value)
+{
+#ifdef __GNUC__
+    return value ? 32 - __builtin_clz(value) : 0;
+#else
+    int bits;
+
+    for (bits = 0; value; value >>= 1)
+        bits++;
+    return bits;
+#endif
+}
+
+// Index of the lowest set bit of a nonzero mask
+static int lowestBit(uint64_t mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(mask);
+#else
+    int bit;
+
+    for (bit = 0; !(mask & 1); mask >>= 1)
+        bit++;
+    return bit;
+#endif
+}
+
+/*
+    Code lengths of an optimal Huffman code for the 256 symbol counts of
+    freq, limited to 16 bits with the all-ones code reserved, exactly as
+    jpeg_gen_optimal_table assigns them. Returns the number of symbols.
+*/
+static int optimalCodeLengths(const unsigned long int *symbolFreq, unsigned char *length)
+{
+    unsigned long int freq[257], v;
+    int codesize[257], others[257], bits[33];
+    int c1, c2, i, j, p, symbols = 0;
+
+    memcpy(freq, symbolFreq, 256 * sizeof(freq[0]));
+    freq[256] = 1;
+    memset(codesize, 0, sizeof(codesize));
+    memset(bits, 0, sizeof(bits));
+    for (i = 0; i < 257; i++)
+        others[i] = -1;
+
+    // Merge the two least frequent trees, preferring the larger symbol
+    for (;;)
+    {
+        c1 = -1;
+        v = (unsigned long int) -1;
+        for (i = 0; i <= 256; i++)
+        {
+            if (freq[i] && freq[i] <= v)
+            {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+
+        c2 = -1;
+        v = (unsigned long int) -1;
+        for (i = 0; i <= 256; i++)
+        {
+            if (freq[i] && freq[i] <= v && i != c1)
+            {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+
+        if (c2 < 0)
+            break;
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        codesize[c1]++;
+        while (others[c1] >= 0)
+        {
+            c1 = others[c1];
+            codesize[c1]++;
         }
-    */
+        others[c1] = c2;
 
-    if (optimize)
-        cinfo.optimize_coding = TRUE;
+        codesize[c2]++;
+        while (others[c2] >= 0)
+        {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
 
-    if (optimize && !progressive)
+    for (i = 0; i <= 256; i++)
     {
-        cinfo.scan_info = NULL;
-        cinfo.num_scans = 0;
-        /*
-        // Mozjpeg:
-                // Moz defaults, disable progressive
-                if (jpeg_c_bool_param_supported(&cinfo, JBOOLEAN_OPTIMIZE_SCANS))
-                    jpeg_c_set_bool_param(&cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
-        */
+        if (codesize[i])
+            bits[MIN(codesize[i], 32)]++;
     }
 
-    if (!optimize && progressive)
+    // Move codes longer than 16 bits up the tree
+    for (i = 32; i > 16; i--)
     {
-        // No moz defaults, set scan progression
-        jpeg_simple_progression(&cinfo);
+        while (bits[i] > 0)
+        {
+            j = i - 2;
+            while (bits[j] == 0)
+                j--;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
     }
 
-    jpeg_set_quality(&cinfo, quality, TRUE);
-    jpeg_set_colorspace (&cinfo, jpegcs);
+    // Drop the reserved code, the last of the longest
+    while (bits[i] == 0)
+        i--;
+    bits[i]--;
 
-    if (subsample == SUBSAMPLE_444)
+    // Lengths go out in order of the original code size, then symbol
+    memset(length, 0, 256);
+    p = 1;
+    for (i = 1; i <= 32; i++)
     {
-        cinfo.comp_info[0].h_samp_factor = 1;
-        cinfo.comp_info[0].v_samp_factor = 1;
-        cinfo.comp_info[1].h_samp_factor = 1;
-        cinfo.comp_info[1].v_samp_factor = 1;
-        cinfo.comp_info[2].h_samp_factor = 1;
-        cinfo.comp_info[2].v_samp_factor = 1;
+        for (j = 0; j < 256; j++)
+        {
+            if (codesize[j] != i)
+                continue;
+            while (p <= 16 && bits[p] == 0)
+                p++;
+            if (p > 16)
+                break;
+            length[j] = p;
+            bits[p]--;
+            symbols++;
+        }
     }
 
-    // Start the compression
-    jpeg_start_compress(&cinfo, TRUE);
+    return symbols;
+}
 
-    // Process scanlines one by one
-    while (cinfo.next_scanline < cinfo.image_height)
+static int tableCodeLengths(const JHUFF_TBL *table, unsigned char *length)
+{
+    int l, i, p = 0;
+
+    memset(length, 0, 256);
+    for (l = 1; l <= 16; l++)
+        for (i = 0; i < table->bits[l]; i++)
+            length[table->huffval[p++]] = l;
+
+    return p;
+}
+
+int dctLumaInit(jpeg_dct_luma *d, const jpeg_planes *p)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    int32_t work[DCTSIZE2];
+    const unsigned char *src;
+    int16_t *coef;
+    int bx, by, x, y;
+
+    if (p->jpegcs != JCS_YCbCr && p->jpegcs != JCS_GRAYSCALE)
+        return 1;
+
+    d->width = p->width;
+    d->height = p->height;
+    d->reference = NULL;
+    d->blocksWide = (p->width + DCTSIZE - 1) / DCTSIZE;
+    d->blocksHigh = (p->height + DCTSIZE - 1) / DCTSIZE;
+    d->coefs = malloc((unsigned long int) d->blocksWide * d->blocksHigh * DCTSIZE2 * sizeof(int16_t));
+    d->totals = calloc(101, sizeof(dct_totals));
+    if (d->coefs == NULL || d->totals == NULL)
     {
-        row_pointer[0] = &buf[cinfo.next_scanline * row_stride];
-        (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        dctLumaFree(d);
+        return 1;
     }
 
-    jpeg_finish_compress(&cinfo);
+    // Planes cover whole MCUs, so every block has all of its samples
+    coef = d->coefs;
+    for (by = 0; by < d->blocksHigh; by++)
+    {
+        for (bx = 0; bx < d->blocksWide; bx++, coef += DCTSIZE2)
+        {
+            for (y = 0; y < DCTSIZE; y++)
+            {
+                src = p->plane[0] + (unsigned long int) (by * DCTSIZE + y) * p->planeWidth[0] + bx * DCTSIZE;
+                for (x = 0; x < DCTSIZE; x++)
+                    work[y * DCTSIZE + x] = src[x] - CENTERJSAMPLE;
+            }
+            fdctIslow(work);
+            for (x = 0; x < DCTSIZE2; x++)
+                coef[x] = work[x];
+        }
+    }
+
+    // Range limit table of jdmaster.c, indexed by the IDCT output & 1023
+    for (x = 0; x < 1024; x++)
+        d->limit[x] = (x < 128) ? x + 128 : (x < 512) ? 255 : (x < 896) ? 0 : x - 896;
+
+    // Code lengths of the standard luma tables used without optimization
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    cinfo.in_color_space = JCS_GRAYSCALE;
+    cinfo.input_components = 1;
+    jpeg_set_defaults(&cinfo);
+    d->dcSymbols = tableCodeLengths(cinfo.dc_huff_tbl_ptrs[0], d->dcLength);
+    d->acSymbols = tableCodeLengths(cinfo.ac_huff_tbl_ptrs[0], d->acLength);
     jpeg_destroy_compress(&cinfo);
 
-    return jpegSize;
+    return 0;
 }
 
-int checkPpmMagic(const unsigned char *buf, unsigned long int size)
+void dctLumaFree(jpeg_dct_luma *d)
 {
-    return (size >= 2 && buf[0] == 'P' && buf[1] == '6');
+    free(d->coefs);
+    free(d->totals);
 }
 
-unsigned long int decodePpm(unsigned char *buf, unsigned long int bufSize, unsigned char **image, int *width, int *height)
+// Squared error and sums of a trial scored in the coefficient domain
+typedef struct
 {
-    unsigned long int ppmSize = 0;
-    unsigned long int pos = 0, imageDataSize;
-    int depth;
+    int64_t error64, sum, sumSq;
+} dct_score;
 
-    if (!checkPpmMagic(buf, bufSize))
-    {
-        error("not a valid PPM format image!");
-        return 0;
-    }
+// Trial table for a quality, and the reciprocals jcdctmgr.c divides by
+typedef struct
+{
+    int quant[DCTSIZE2], shift[DCTSIZE2], position[DCTSIZE2];
+    uint32_t recip[DCTSIZE2], corr[DCTSIZE2];
+    // A coefficient quantizes to zero below its limit
+    int16_t zero[DCTSIZE2];
+} dct_table;
 
-    // Read to first newline
-    while (buf[pos++] != '\n' && pos < bufSize);
+static void dctLumaTable(int quality, dct_table *t)
+{
+    int k, scale, divisor;
+    uint32_t need;
 
-    // Discard for any comment and empty lines
-    while ((buf[pos] == '#' || buf[pos] == '\n') && pos < bufSize)
+    scale = jpeg_quality_scaling(quality);
+    for (k = 0; k < DCTSIZE2; k++)
     {
-        while (buf[pos] != '\n')
+        t->quant[k] = clamp(1, (stdLumaQuant[k] * scale + 50) / 100, 255);
+        divisor = t->quant[k] << 3;
+        t->shift[k] = 16 + magnitudeBits(divisor) - 1;
+        t->recip[k] = ((uint32_t) 1 << t->shift[k]) / divisor;
+        t->corr[k] = divisor / 2;
+        if (((uint32_t) 1 << t->shift[k]) % divisor == 0)
         {
-            pos++;
+            t->recip[k] >>= 1;
+            t->shift[k]--;
         }
-        pos++;
+        else if (((uint32_t) 1 << t->shift[k]) % divisor <= (uint32_t) divisor / 2)
+        {
+            t->corr[k]++;
+        }
+        else
+        {
+            t->recip[k]++;
+        }
+        t->position[zigzagOrder[k]] = k;
+
+        need = (((uint32_t) 1 << t->shift[k]) + t->recip[k] - 1) / t->recip[k];
+        t->zero[k] = (need > t->corr[k]) ? need - t->corr[k] : 0;
     }
+}
 
-    if (pos >= bufSize)
+/*
+    Quantize coefficients from to to - 1 of a block, rounding half away
+    from zero, and mark the nonzero ones by their zigzag position.
+*/
+static uint64_t quantizeBlock(const int16_t *coef, const dct_table *t, int from, int to, JCOEF *block)
+{
+    uint64_t nonzero = 0;
+    int32_t value, sign, magnitude;
+    int k;
+
+    for (k = from; k < to; k++)
     {
-        error("not a valid PPM format image!");
-        return 0;
+        value = coef[k];
+        sign = value >> 31;
+        magnitude = ((uint32_t) ((value ^ sign) - sign + t->corr[k]) * t->recip[k]) >> t->shift[k];
+        block[k] = (magnitude ^ sign) - sign;
+        nonzero |= (uint64_t) (magnitude != 0) << t->position[k];
     }
 
-    // Read width/height
-    sscanf((const char *) buf + pos, "%d %d", width, height);
+    return nonzero;
+}
 
-    // Go to next line
-    while (buf[pos++] != '\n' && pos < bufSize);
+// AC symbols and extra bits of a block as jchuff.c codes them, times sign
+static void countAc(const JCOEF *block, uint64_t nonzero, long int *freq, int64_t *bits, int sign)
+{
+    int k, run, nbits, last = 0;
 
-    if (pos >= bufSize)
+    for (nonzero &= ~(uint64_t) 1; nonzero; nonzero &= nonzero - 1)
     {
-        error("not a valid PPM format image!");
-        return 0;
+        k = lowestBit(nonzero);
+        for (run = k - last - 1; run > 15; run -= 16)
+            freq[0xf0] += sign;
+        nbits = magnitudeBits(abs(block[zigzagOrder[k]]));
+        freq[(run << 4) + nbits] += sign;
+        *bits += sign * nbits;
+        last = k;
     }
+    if (last < DCTSIZE2 - 1)
+        freq[0] += sign;
+}
 
-    // Read bit depth
-    sscanf((const char*) buf + pos, "%d", &depth);
+/*
+    Error and energy of the AC of a whole block by Parseval: the forward
+    DCT is 8 times the orthonormal one and a coefficient comes back as
+    8 * quant * level, so a block's pixel error is that of its
+    coefficients over 64.
+*/
+static void acError(const int16_t *coef, const JCOEF *block, const int *quant, int64_t *error64, int64_t *energy, int sign)
+{
+    int64_t level;
+    int k;
 
-    if (depth != 255)
+    for (k = 1; k < DCTSIZE2; k++)
     {
-        error("unsupported bit depth: %d", depth);
-        return 0;
+        level = (int64_t) block[k] * quant[k];
+        *error64 += sign * (coef[k] - 8 * level) * (coef[k] - 8 * level);
+        *energy += sign * level * level;
     }
+}
 
-    // Go to next line
-    while (buf[pos++] != '\n' && pos < bufSize);
+// All coefficients of a block smaller in magnitude than their limits
+static int belowLimits(const int16_t *coef, const int16_t *limit)
+{
+    int k, over = 0;
 
-    // Width * height * red/green/blue
-    imageDataSize = (*width) * (*height) * 3;
-    if (pos + imageDataSize != bufSize)
+    for (k = 0; k < DCTSIZE2; k++)
+        over |= abs(coef[k]) >= limit[k];
+
+    return !over;
+}
+
+/*
+    Quantize and size a trial. Its luma is rebuilt into gray, or without
+    gray scored into score: whole blocks from their coefficients, with
+    the error 64 times over, and edge blocks from their pixels.
+
+    The AC of whole blocks are kept by quality once scored. From an
+    earlier quality from, a block whose AC quantize to zero wherever the
+    two tables differ keeps its AC levels, symbols and error, so only
+    the blocks that changed are requantized, at both qualities, and
+    their difference applied. When more than a third changed, the trial
+    is scored from scratch.
+*/
+static unsigned long int dctLumaRun(jpeg_dct_luma *d, int quality, int from, int optimize, unsigned char *gray, dct_score *score)
+{
+    unsigned long int dcFreq[256], acFreq[256];
+    long int wholeFreq[256], edgeFreq[256];
+    unsigned char dcOptimal[256], acOptimal[256], pixels[DCTSIZE2], *out;
+    const unsigned char *dcLength = d->dcLength, *acLength = d->acLength;
+    dct_table t, previous;
+    dct_totals *totals;
+    int16_t limit[DCTSIZE2];
+    JCOEF block[DCTSIZE2], old[DCTSIZE2];
+    const int16_t *coef;
+    uint64_t nonzero;
+    int64_t bits = 0, wholeBits = 0, wholeError64 = 0, wholeEnergy = 0, level;
+    int32_t value;
+    int bx, by, k, x, y, nbits, edge, clean, incremental, lastDc = 0;
+    int dcSymbols = d->dcSymbols, acSymbols = d->acSymbols;
+    unsigned long int changed = 0, sampled = 0;
+    const unsigned char *ref;
+
+    dctLumaTable(quality, &t);
+
+    // Blocks keep their AC when every coefficient at a step that changed
+    // stays below both zero limits
+    incremental = score && from > 0 && d->totals[from].known;
+    if (incremental)
     {
-        error("incorrect image size: %lu vs. %lu", bufSize, pos + imageDataSize);
-        return 0;
+        dctLumaTable(from, &previous);
+        limit[0] = INT16_MAX;
+        for (k = 1; k < DCTSIZE2; k++)
+            limit[k] = (t.quant[k] == previous.quant[k]) ? INT16_MAX : MIN(t.zero[k], previous.zero[k]);
+
+        // Requantizing a changed block twice only pays when most keep
+        // their AC; a sample of the blocks tells
+        for (by = 0; by < d->height / DCTSIZE; by++)
+        {
+            for (bx = by % DCT_SAMPLE_STEP; bx < d->width / DCTSIZE; bx += DCT_SAMPLE_STEP)
+            {
+                coef = d->coefs + ((unsigned long int) by * d->blocksWide + bx) * DCTSIZE2;
+                changed += !belowLimits(coef, limit);
+                sampled++;
+            }
+        }
+        incremental = 3 * changed <= sampled;
     }
 
-    // Allocate image pixel buffer
-    *image = malloc(imageDataSize);
+    memset(dcFreq, 0, sizeof(dcFreq));
+    memset(wholeFreq, 0, sizeof(wholeFreq));
+    memset(edgeFreq, 0, sizeof(edgeFreq));
 
-    // Copy pixel data
-    memcpy((void *) *image, (void *) buf + pos, imageDataSize);
+    coef = d->coefs;
+    for (by = 0; by < d->blocksHigh; by++)
+    {
+        for (bx = 0; bx < d->blocksWide; bx++, coef += DCTSIZE2)
+        {
+            edge = (by + 1) * DCTSIZE > d->height || (bx + 1) * DCTSIZE > d->width;
+            clean = incremental && !edge && belowLimits(coef, limit);
 
-    ppmSize = (*width) * (*height);
+            // A clean block only needs its DC
+            nonzero = quantizeBlock(coef, &t, 0, clean ? 1 : DCTSIZE2, block);
 
-    return ppmSize;
+            // Symbols and extra bits of the scan, as jchuff.c codes them
+            value = block[0] - lastDc;
+            lastDc = block[0];
+            nbits = magnitudeBits(abs(value));
+            dcFreq[nbits]++;
+            bits += nbits;
+
+            if (edge)
+            {
+                countAc(block, nonzero, edgeFreq, &bits, 1);
+            }
+            else if (!clean)
+            {
+                countAc(block, nonzero, wholeFreq, &wholeBits, 1);
+                if (score)
+                    acError(coef, block, t.quant, &wholeError64, &wholeEnergy, 1);
+
+                // Take the block out of the earlier quality's totals
+                if (incremental)
+                {
+                    nonzero = quantizeBlock(coef, &previous, 1, DCTSIZE2, old);
+                    countAc(old, nonzero, wholeFreq, &wholeBits, -1);
+                    acError(coef, old, previous.quant, &wholeError64, &wholeEnergy, -1);
+                }
+            }
+
+            // The DC of a whole block gives the sum of its pixels
+            if (score && !edge)
+            {
+                level = (int64_t) block[0] * t.quant[0];
+                score->error64 += (coef[0] - 8 * level) * (coef[0] - 8 * level);
+                score->sum += 8 * level + DCTSIZE2 * CENTERJSAMPLE;
+                score->sumSq += level * level + 16 * CENTERJSAMPLE * level + DCTSIZE2 * CENTERJSAMPLE * CENTERJSAMPLE;
+                continue;
+            }
+
+            // Luma as the decoder shows it, edge blocks cropped to the image
+            if (score)
+            {
+                idctIslow(block, t.quant, d->limit, pixels, DCTSIZE);
+                for (y = 0; y < DCTSIZE && by * DCTSIZE + y < d->height; y++)
+                {
+                    ref = d->reference + (unsigned long int) (by * DCTSIZE + y) * d->width + bx * DCTSIZE;
+                    for (x = 0; x < DCTSIZE && bx * DCTSIZE + x < d->width; x++)
+                    {
+                        value = ref[x] - pixels[y * DCTSIZE + x];
+                        score->error64 += DCTSIZE2 * value * value;
+                        score->sum += pixels[y * DCTSIZE + x];
+                        score->sumSq += pixels[y * DCTSIZE + x] * pixels[y * DCTSIZE + x];
+                    }
+                }
+                continue;
+            }
+
+            out = gray + (unsigned long int) by * DCTSIZE * d->width + bx * DCTSIZE;
+            if (!edge)
+            {
+                idctIslow(block, t.quant, d->limit, out, d->width);
+                continue;
+            }
+
+            idctIslow(block, t.quant, d->limit, pixels, DCTSIZE);
+            for (y = 0; y < DCTSIZE && by * DCTSIZE + y < d->height; y++)
+                memcpy(out + (unsigned long int) y * d->width, pixels + y * DCTSIZE, MIN(DCTSIZE, d->width - bx * DCTSIZE));
+        }
+    }
+
+    // Whole block AC of this quality, kept for later trials
+    if (score)
+    {
+        totals = &d->totals[quality];
+        if (incremental)
+        {
+            for (k = 0; k < 256; k++)
+                wholeFreq[k] += d->totals[from].acFreq[k];
+            wholeBits += d->totals[from].acBits;
+            wholeError64 += d->totals[from].error64;
+            wholeEnergy += d->totals[from].energy;
+        }
+        for (k = 0; k < 256; k++)
+            totals->acFreq[k] = wholeFreq[k];
+        totals->acBits = wholeBits;
+        totals->error64 = wholeError64;
+        totals->energy = wholeEnergy;
+        totals->known = 1;
+
+        score->error64 += wholeError64;
+        score->sumSq += wholeEnergy;
+    }
+
+    for (k = 0; k < 256; k++)
+        acFreq[k] = wholeFreq[k] + edgeFreq[k];
+    bits += wholeBits;
+
+    if (optimize)
+    {
+        dcSymbols = optimalCodeLengths(dcFreq, dcOptimal);
+        acSymbols = optimalCodeLengths(acFreq, acOptimal);
+        dcLength = dcOptimal;
+        acLength = acOptimal;
+    }
+
+    for (k = 0; k < 256; k++)
+        bits += (int64_t) (dcFreq[k] * dcLength[k] + acFreq[k] * acLength[k]);
+
+    return GRAY_JPEG_OVERHEAD + 2 * DHT_OVERHEAD + dcSymbols + acSymbols + (unsigned long int) ((bits + 7) / 8);
 }
 
-enum filetype detectFiletype(const char *filename)
+unsigned long int dctLumaTrial(jpeg_dct_luma *d, int quality, int optimize, unsigned char **gray)
 {
-    unsigned char *buf = NULL;
-    long bufSize = 0;
-    bufSize = readFile((char *)filename, (void **)&buf);
-    enum filetype ret = detectFiletypeFromBuffer(buf, bufSize);
-    free(buf);
-    return ret;
+    *gray = malloc((unsigned long int) d->width * d->height);
+    if (*gray == NULL)
+        return 0;
+
+    return dctLumaRun(d, quality, 0, optimize, *gray, NULL);
 }
 
-enum filetype detectFiletypeFromBuffer(unsigned char *buf, unsigned long int bufSize)
+void dctLumaReference(jpeg_dct_luma *d, const jpeg_planes *p, const unsigned char *gray)
 {
-    if (checkJpegMagic(buf, bufSize))
-        return FILETYPE_JPEG;
+    const unsigned char *ref, *y0;
+    int diff, x, y;
 
-    if (checkPpmMagic(buf, bufSize))
-        return FILETYPE_PPM;
+    d->reference = gray;
+    d->mismatch = 0;
+    for (y = 0; y < d->height / DCTSIZE * DCTSIZE; y++)
+    {
+        ref = gray + (unsigned long int) y * d->width;
+        y0 = p->plane[0] + (unsigned long int) y * p->planeWidth[0];
+        for (x = 0; x < d->width / DCTSIZE * DCTSIZE; x++)
+        {
+            diff = ref[x] - y0[x];
+            d->mismatch += diff * diff;
+        }
+    }
 
-    return FILETYPE_UNKNOWN;
+    // Half of the sums over both images, as MetricPrepare keeps them
+    pixelMoments(gray, gray, (size_t) d->width * d->height, &d->refSum, &d->refSumSq);
+    d->refSum /= 2;
+    d->refSumSq /= 2;
 }
 
-unsigned long int decodeFile(const char *filename, unsigned char **image, enum filetype type, int *width, int *height, int pixelFormat)
+int dctLumaScored(int method)
 {
-    unsigned char *buf = NULL;
-    int jpegcs;
-    unsigned long int bufSize = 0;
-    bufSize = readFile((char *)filename, (void **)&buf);
-    unsigned long int ret = decodeFileFromBuffer(buf, bufSize, image, type, width, height, &jpegcs, pixelFormat);
-    free(buf);
-    return ret;
+    return method == MSE || method == PSNR || method == MSEF;
 }
 
-unsigned long int decodeFileFromBuffer(unsigned char *buf, unsigned long int bufSize, unsigned char **image, enum filetype type, int *width, int *height, int *jpegcs, int pixelFormat)
+unsigned long int dctLumaScore(jpeg_dct_luma *d, int method, int quality, int from, int optimize, float *metric)
 {
-    switch (type)
+    dct_score score = { 0, 0, 0 };
+    unsigned long int size;
+    size_t n = (size_t) d->width * d->height;
+    double mse, mean, rounding;
+    float stdev2;
+
+    size = dctLumaRun(d, quality, from, optimize, NULL, &score);
+
+    // The decoder rounds whole blocks to integers, adding 1/12 a pixel
+    // of uniform error. The Y plane and the reference luma differ by
+    // their color conversions. Both are independent of the trial error.
+    rounding = (double) (d->width / DCTSIZE) * (d->height / DCTSIZE) * DCTSIZE2 / 12.0;
+    mse = ((double) score.error64 / DCTSIZE2 + rounding + d->mismatch) / n;
+
+    switch (method)
     {
-    case FILETYPE_PPM:
-        *jpegcs = JCS_RGB;
-        return decodePpm(buf, bufSize, image, width, height);
-    case FILETYPE_JPEG:
-        return decodeJpeg(buf, bufSize, image, width, height, jpegcs, pixelFormat);
+    case MSE:
+        *metric = (float) mse;
+        break;
+    case PSNR:
+        *metric = (mse > 0.0) ? (float) (10.0 * log10(255.0 * 255.0 / mse)) : 0.0f;
+        break;
     default:
-        return 0;
+        mean = (double) (score.sum + (int64_t) d->refSum) / (2 * n);
+        stdev2 = (float) (((double) (score.sumSq + (int64_t) d->refSumSq) + rounding) / (2 * n) - mean * mean);
+        stdev2 = (stdev2 > 0.0f) ? stdev2 : 1.0f;
+        *metric = sqrt((float) mse / stdev2);
+        break;
     }
+
+    return size;
 }
 
-int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **meta, unsigned int *metaSize, const char *comment)
+int scanJpegHeader(const unsigned char *buf, unsigned long int bufSize, jpeg_header *header, const char *comment)
 {
-    unsigned int pos = 0;
-    unsigned int totalSize = 0;
-    unsigned int offsets[20];
-    unsigned int sizes[20];
-    unsigned int count = 0;
-    unsigned int marker;
-    int size, x;
+    unsigned long int pos = 2, end;
+    unsigned int marker, size, n, k;
+    int sof = 0, c;
 
-    // Read through all the file markers
-    while (pos < bufSize && count < 20)
-    {
-        marker = (buf[pos] << 8) + buf[pos + 1];
+    memset(header, 0, sizeof(*header));
 
-        //printf("Marker %x at %u\n", marker, pos);
+    if (!checkJpegMagic(buf, bufSize))
+        return 1;
 
-        if (marker == 0xffda /* SOS */)
+    while (pos + 4 <= bufSize)
+    {
+        // Skip extraneous bytes up to the next marker, as libjpeg does
+        if (buf[pos] != 0xff)
         {
-            // This is the end, so stop!
-            break;
+            pos++;
+            continue;
         }
-        else if (marker == 0xffdd /* DRI */)
+
+        // Skip fill bytes
+        marker = buf[pos + 1];
+        if (marker == 0xff)
         {
-            pos += 2 + 4;
+            pos++;
+            continue;
         }
-        else if (marker >= 0xffd0 && marker <= 0xffd9 /* RST0+x */)
+
+        // Standalone markers: TEM, RST0+x
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
         {
             pos += 2;
+            continue;
         }
-        else
-        {
-            // Marker has a custom size, read it in
-            size = (buf[pos + 2] << 8) + buf[pos + 3];
-            //printf("Size is %i (%x)\n", size, size);
 
-            // Save APP0+x and COM markers
-            if ((marker >= 0xffe1 && marker <= 0xffef) || marker == 0xfffe)
+        if (marker == 0xd9 /* EOI */)
+            break;
+
+        size = (buf[pos + 2] << 8) + buf[pos + 3];
+        end = pos + 2 + size;
+        if (size < 2 || end > bufSize)
+            return 1;
+
+        if (marker == 0xda /* SOS */)
+            break;
+        else if (marker == 0xdb /* DQT */)
+        {
+            // One segment may hold several tables, 8 or 16 bit each
+            pos += 4;
+            while (pos < end)
             {
-                if (marker == 0xfffe && comment != NULL && !strncmp(comment, (char *) buf + pos + 4, strlen(comment)))
-                {
+                n = buf[pos] & 0x0f;
+                c = buf[pos] >> 4;
+                pos++;
+                if (n > 3 || pos + (c ? 128 : 64) > end)
                     return 1;
+                for (k = 0; k < DCTSIZE2; k++)
+                {
+                    header->quant[n][zigzagOrder[k]] = c ? (buf[pos] << 8) + buf[pos + 1] : buf[pos];
+                    pos += c ? 2 : 1;
                 }
-
-                totalSize += size + 2;
-                offsets[count] = pos;
-                sizes[count] = size + 2;
-                count++;
+                header->quantDefined[n] = 1;
             }
-
-            pos += 2 + size;
         }
+        else if ((marker >= 0xc0 && marker <= 0xcf) && marker != 0xc4 /* DHT */ && marker != 0xc8 /* JPG */ && marker != 0xcc /* DAC */)
+        {
+            if (size < 8)
+                return 1;
+            header->precision = buf[pos + 4];
+            header->height = (buf[pos + 5] << 8) + buf[pos + 6];
+            header->width = (buf[pos + 7] << 8) + buf[pos + 8];
+            header->components = buf[pos + 9];
+            header->progressive = (marker == 0xc2 || marker == 0xc6 || marker == 0xca || marker == 0xce);
+            if (size < 8 + 3 * (unsigned int) header->components)
+                return 1;
+            for (c = 0; c < header->components && c < 4; c++)
+                header->quantTable[c] = buf[pos + 12 + 3 * c] & 0x03;
+            sof = 1;
+        }
+        else if (marker == 0xfe /* COM */ && comment != NULL)
+        {
+            if (size - 2 >= strlen(comment) && !strncmp(comment, (const char *) buf + pos + 4, strlen(comment)))
+                header->processed = 1;
+        }
+
+        pos = end;
     }
 
-    // Allocate the metadata buffer
-    *meta = malloc(totalSize);
-    *metaSize = totalSize;
+    if (!sof)
+        return 1;
 
-    // Copy over all the metadata into the new buffer
-    pos = 0;
-    for (x = 0; x < count; x++)
-    {
-        memcpy(((*meta) + pos), (buf + offsets[x]), sizes[x]);
-        pos += sizes[x];
-    }
+    if (header->quantDefined[header->quantTable[0]])
+        header->quality = estimateJpegQuality(header->quant[header->quantTable[0]], 0);
 
     return 0;
 }
@@ -820,6 +3514,8 @@ int parseSubsampling(const char *s)
         return SUBSAMPLE_DEFAULT;
     else if (!strcmp("disable", s))
         return SUBSAMPLE_444;
+    else if (!strcmp("422", s))
+        return SUBSAMPLE_422;
 
     error("unknown sampling method: %s", s);
     return SUBSAMPLE_DEFAULT;
@@ -901,6 +3597,39 @@ enum METHOD parseMethod(const char *s)
     return UNKNOWN;
 }
 
+int parseMethods(const char *s, int *methods)
+{
+    char name[32];
+    size_t length;
+    int count = 0, method, x;
+
+    if (!strcmp("all", s))
+    {
+        for (method = MPE; method <= SUMMET; method++)
+            methods[count++] = method;
+        return count;
+    }
+
+    while (1)
+    {
+        length = strcspn(s, ",");
+        if (length >= sizeof(name))
+            return 0;
+        memcpy(name, s, length);
+        name[length] = '\0';
+
+        if ((method = parseMethod(name)) == UNKNOWN)
+            return 0;
+        for (x = 0; x < count && methods[x] != method; x++);
+        if (x == count)
+            methods[count++] = method;
+
+        if (!s[length])
+            return count;
+        s += length + 1;
+    }
+}
+
 float MetricRescale(int currentmethod, float value)
 {
     float k1;
@@ -1066,9 +3795,89 @@ float MetricSigma(float cor)
     return sigma;
 }
 
+// Components of SUMMET and the pair methods, in the order they combine
+static const int summetMethods[MAX_SUM_COUNT] = { SSIM, SMALLFRY, SHARPENBAD, NHW, VIFP1 };
+static const int ssimfryMethods[2] = { SSIM, SMALLFRY };
+static const int ssimshbadMethods[2] = { SSIM, SHARPENBAD };
+
+// One component metric of a combined method, evaluated on a worker thread
+typedef struct
+{
+    int method;
+    unsigned char *image1, *image2;
+    int width, height, components;
+    float score;
+} metric_job;
+
+static void runMetricJob(void *arg)
+{
+    metric_job *job = arg;
+    float value;
+
+    switch (job->method)
+    {
+    case SSIM:
+        value = iqa_ssim(job->image1, job->image2, job->width, job->height, job->width * job->components, 0, 0);
+        break;
+    case SMALLFRY:
+        value = metric_smallfry(job->image1, job->image2, job->width, job->height);
+        break;
+    case SHARPENBAD:
+        value = metric_sharpenbad(job->image1, job->image2, job->width, job->height, 1);
+        break;
+    case NHW:
+        value = metric_nhw(job->image1, job->image2, job->width, job->height);
+        break;
+    case VIFP1:
+    default:
+        value = iqa_vifp1(job->image1, job->image2, job->width, job->height, job->width * job->components, 0, 0);
+        break;
+    }
+
+    job->score = MetricRescale(job->method, value);
+}
+
+/*
+    Rescaled scores of the given component methods. Each one is a whole
+    image pass of its own, so they run side by side and every score is
+    the same as computed alone.
+*/
+static void metricScores(const int *methods, int count, unsigned char *image1, unsigned char *image2, int width, int height, int components, float *scores)
+{
+    metric_job jobs[MAX_SUM_COUNT];
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        jobs[i].method = methods[i];
+        jobs[i].image1 = image1;
+        jobs[i].image2 = image2;
+        jobs[i].width = width;
+        jobs[i].height = height;
+        jobs[i].components = components;
+    }
+
+    parallelRun(runMetricJob, jobs, sizeof(metric_job), count, metricThreadCount());
+
+    for (i = 0; i < count; i++)
+        scores[i] = jobs[i].score;
+}
+
+/*
+    Rescaled scores of the SUMMET components SSIM, SMALLFRY, SHARPENBAD,
+    NHW and VIFP1, in that order, which SUMMET combines with waverage.
+    Returns the number of scores.
+*/
+static int metricSumScores(unsigned char *image1, unsigned char *image2, int width, int height, int components, float *scores)
+{
+    metricScores(summetMethods, MAX_SUM_COUNT, image1, image2, width, height, components, scores);
+
+    return MAX_SUM_COUNT;
+}
+
 float MetricCalc(int method, unsigned char *image1, unsigned char *image2, int width, int height, int components)
 {
-    float diff, tmetric, tm[MAX_SUM_COUNT];
+    float diff, tm[MAX_SUM_COUNT];
 
     // Calculate and print comparison
     switch (method)
@@ -1107,32 +3916,16 @@ float MetricCalc(int method, unsigned char *image1, unsigned char *image2, int w
         diff = metric_nhw(image1, image2, width, height);
         break;
     case SSIMFRY:
-        tmetric = iqa_ssim(image1, image2, width, height, width * components, 0, 0);
-        diff = MetricRescale(SSIM, tmetric);
-        tmetric = metric_smallfry(image1, image2, width, height);
-        diff += MetricRescale(SMALLFRY, tmetric);
-        diff *= 0.5f;
+        metricScores(ssimfryMethods, 2, image1, image2, width, height, components, tm);
+        diff = (tm[0] + tm[1]) * 0.5f;
         break;
     case SSIMSHBAD:
-        tmetric = iqa_ssim(image1, image2, width, height, width * components, 0, 0);
-        diff = MetricRescale(SSIM, tmetric);
-        tmetric = metric_sharpenbad(image1, image2, width, height, 1);
-        diff += MetricRescale(SHARPENBAD, tmetric);
-        diff *= 0.5f;
+        metricScores(ssimshbadMethods, 2, image1, image2, width, height, components, tm);
+        diff = (tm[0] + tm[1]) * 0.5f;
         break;
     case SUMMET:
     default:
-        tmetric = iqa_ssim(image1, image2, width, height, width * components, 0, 0);
-        tm[0] = MetricRescale(SSIM, tmetric);
-        tmetric = metric_smallfry(image1, image2, width, height);
-        tm[1] = MetricRescale(SMALLFRY, tmetric);
-        tmetric = metric_sharpenbad(image1, image2, width, height, 1);
-        tm[2] = MetricRescale(SHARPENBAD, tmetric);
-        tmetric = metric_nhw(image1, image2, width, height);
-        tm[3] = MetricRescale(NHW, tmetric);
-        tmetric = iqa_vifp1(image1, image2, width, height, width * components, 0, 0);
-        tm[4] = MetricRescale(VIFP1, tmetric);
-        diff = waverage(tm, 5);
+        diff = waverage(tm, metricSumScores(image1, image2, width, height, components, tm));
         break;
     }
     if (diff == INFINITY)
@@ -1142,9 +3935,278 @@ float MetricCalc(int method, unsigned char *image1, unsigned char *image2, int w
     return diff;
 }
 
+void MetricPrepare(metric_context *ctx, int method, unsigned char *reference, int width, int height, int components)
+{
+    uint64_t sum, sumSq;
+
+    ctx->method = method;
+    ctx->reference = reference;
+    ctx->width = width;
+    ctx->height = height;
+    ctx->components = components;
+    ctx->prepared = 0;
+
+    // MSEF spreads over both images, so half of its sums never change.
+    // A buffer passed as both images is counted twice.
+    if (method == MSEF && components == 1)
+    {
+        pixelMoments(reference, reference, (size_t) width * height, &sum, &sumSq);
+        ctx->sum = sum / 2;
+        ctx->sumSq = sumSq / 2;
+        ctx->prepared = 1;
+    }
+}
+
+float MetricCalcPrepared(const metric_context *ctx, unsigned char *compressed)
+{
+    uint64_t sum, sumSq;
+    size_t n = (size_t) ctx->width * ctx->height;
+    double mean;
+    float mse, stdev2;
+
+    if (!ctx->prepared)
+        return MetricCalc(ctx->method, ctx->reference, compressed, ctx->width, ctx->height, ctx->components);
+
+    // The same arithmetic as metric_msef, with the reference sums cached
+    mse = (float) ((double) pixelSsd(ctx->reference, compressed, n) / n);
+    pixelMoments(compressed, compressed, n, &sum, &sumSq);
+    sum = sum / 2 + ctx->sum;
+    sumSq = sumSq / 2 + ctx->sumSq;
+    mean = (double) sum / (2 * n);
+    stdev2 = (float) ((double) sumSq / (2 * n) - mean * mean);
+    stdev2 = (stdev2 > 0.0f) ? stdev2 : 1.0f;
+    mse /= stdev2;
+
+    return sqrt(mse);
+}
+
+int qualityPrior(int method, float target)
+{
+    float drop;
+
+    // Typical drop at the medium preset (UM 0.75)
+    switch (method)
+    {
+    case MPE:
+        drop = 24.0f;
+        break;
+    case PSNR:
+    case MSE:
+    case MSEF:
+        drop = 20.0f;
+        break;
+    case SMALLFRY:
+    case NHW:
+        drop = 18.0f;
+        break;
+    case SSIM:
+    case MS_SSIM:
+    case VIFP1:
+    case SHARPENBAD:
+    case COR:
+    case SSIMFRY:
+    case SSIMSHBAD:
+    case SUMMET:
+    default:
+        drop = 16.0f;
+        break;
+    }
+
+    // Higher targets leave less room below the source
+    drop *= clamp(0.0f, (1.0f - target) * 4.0f, 2.0f);
+
+    return (int)(drop + 0.5f);
+}
+
+void seedQualityRange(int method, float target, int sourceQuality, int bias, int *min, int *max)
+{
+    int center, low, high;
+
+    center = sourceQuality - qualityPrior(method, target) - bias;
+    low = MAX(center - SEED_RADIUS, *min);
+    high = MIN(center + SEED_RADIUS, *max);
+
+    // Keep the full range when the guess falls outside of it
+    if (low < high)
+    {
+        *min = low;
+        *max = high;
+    }
+}
+
+enum SEARCH_STRATEGY parseSearch(const char *s)
+{
+    if (!strcmp("bisect", s))
+        return SEARCH_BISECT;
+    else if (!strcmp("secant", s))
+        return SEARCH_SECANT;
+    else if (!strcmp("hybrid", s))
+        return SEARCH_HYBRID;
+
+    error("unknown search strategy: %s", s);
+    return SEARCH_BISECT;
+}
+
+void searchInit(quality_search *qs, int strategy, float target, int min, int max)
+{
+    qs->strategy = strategy;
+    qs->target = target;
+    qs->min = min;
+    qs->max = max;
+    qs->minKnown = 0;
+    qs->maxKnown = 0;
+    qs->minMetric = 0.0f;
+    qs->maxMetric = 0.0f;
+    qs->width = 2 * (max - min) + 1;
+    qs->lastSide = 0;
+    qs->steps = searchSteps(qs);
+}
+
+int searchNext(const quality_search *qs)
+{
+    int bisect = (qs->max + qs->min + 1) / 2;
+    int quality;
+    float x;
+
+    if (qs->strategy == SEARCH_BISECT || qs->max - qs->min <= 1)
+        return bisect;
+    if (!qs->minKnown || !qs->maxKnown || qs->maxMetric <= qs->minMetric)
+        return bisect;
+
+    // Hybrid: bisect when the last step did not halve the bracket
+    if (qs->strategy == SEARCH_HYBRID && 2 * (qs->max - qs->min) > qs->width)
+        return bisect;
+
+    // Linear UM model between the edges, rounded up to a whole quality
+    x = qs->min + (qs->target - qs->minMetric) * (qs->max - qs->min) / (qs->maxMetric - qs->minMetric);
+    quality = (int) ceilf(x);
+
+    return searchClamp(qs->min, qs->max, quality, qs->steps);
+}
+
+void searchUpdate(quality_search *qs, int quality, float metric)
+{
+    int side = (metric < qs->target) ? 1 : -1;
+
+    qs->width = qs->max - qs->min;
+    qs->steps = MAX(qs->steps - 1, 0);
+
+    if (side > 0)
+    {
+        qs->min = MIN(quality, qs->max);
+        qs->minKnown = 1;
+        qs->minMetric = metric;
+
+        // Illinois: a stale edge pulls the model too hard, damp it
+        if (qs->lastSide > 0 && qs->maxKnown)
+            qs->maxMetric = qs->target + 0.5f * (qs->maxMetric - qs->target);
+    }
+    else
+    {
+        qs->max = MAX(quality, qs->min);
+        qs->maxKnown = 1;
+        qs->maxMetric = metric;
+
+        if (qs->lastSide < 0 && qs->minKnown)
+            qs->minMetric = qs->target + 0.5f * (qs->minMetric - qs->target);
+    }
+
+    qs->lastSide = side;
+}
+
+int searchDone(const quality_search *qs)
+{
+    // Also done once the answer is confirmed right next to min
+    return qs->min >= qs->max || (qs->max - qs->min == 1 && qs->maxKnown);
+}
+
+int searchSteps(const quality_search *qs)
+{
+    int steps;
+
+    for (steps = 1; (1 << (steps - 1)) < qs->max - qs->min; steps++);
+
+    return steps;
+}
+
+int searchWiden(quality_search *qs, int lowest, int highest, int *attempt)
+{
+
+    if (!searchDone(qs))
+        return 0;
+
+    // Every trial was below the target: the answer may lie higher
+    if (!qs->maxKnown && qs->max < highest)
+    {
+        qs->max = highest;
+    }
+    // Every trial reached the target: the answer may lie lower
+    else if (!qs->minKnown && qs->min > lowest)
+    {
+        qs->min = lowest;
+    }
+    else
+    {
+        return 0;
+    }
+
+    qs->width = 2 * (qs->max - qs->min) + 1;
+    qs->lastSide = 0;
+
+    *attempt = MAX(*attempt, searchSteps(qs));
+    qs->steps = *attempt;
+
+    return 1;
+}
+
+int searchClamp(int min, int max, int quality, int steps)
+{
+    int width = max - min, shift, end, widest, low, high;
+
+    if (steps < 2 || width <= 1)
+        return (max + min + 1) / 2;
+
+    // Bisection halves the bracket on each trial but the last, which
+    // confirms the answer, and ends up end wide
+    shift = MIN(steps - 1, 16);
+    end = (width + (1 << shift) - 1) >> shift;
+    widest = end << (shift - 1);
+
+    // Either outcome of the step must leave at most widest, and the step
+    // stays strictly inside the bracket so every step shrinks it
+    low = MAX(min + 1, max - widest);
+    high = MIN(max - 1, min + widest);
+
+    return (quality < low) ? low : ((quality > high) ? high : quality);
+}
+
+int searchVertex(int min, int max, const int *x, const float *y, int *vertex)
+{
+    float d01, d12, d02, a, b, v;
+
+    if (x[0] == x[1] || x[1] == x[2] || x[0] == x[2])
+        return 0;
+
+    // Divided differences of the interpolating parabola
+    d01 = (y[1] - y[0]) / (x[1] - x[0]);
+    d12 = (y[2] - y[1]) / (x[2] - x[1]);
+    d02 = x[2] - x[0];
+    a = (d12 - d01) / d02;
+    b = d01 - a * (x[0] + x[1]);
+
+    // Only a concave parabola has a maximum
+    if (a >= 0.0f)
+        return 0;
+
+    v = -b / (2.0f * a);
+    *vertex = (int) floorf(v + 0.5f);
+
+    return (*vertex > min && *vertex < max);
+}
+
 int compareFastFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char *imageBuf2, long bufSize2, int printPrefix, int size)
 {
-    unsigned char *hash1, *hash2;
+    uint64_t *hash1, *hash2;
 
     // Generate hashes
     if (jpegHashFromBuffer(imageBuf1, bufSize1, &hash1, size))
@@ -1171,72 +4233,223 @@ int compareFastFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char
     return 0;
 }
 
-int compareFromBuffer(int method, unsigned char *imageBuf1, long bufSize1, unsigned char *imageBuf2, long bufSize2, int printPrefix, int umscale, enum filetype inputFiletype1, enum filetype inputFiletype2)
+// Components a method compares, RGB or luma
+static int compareComponents(int method)
 {
-    unsigned char *image1, *image2, *image1Gray = NULL, *image2Gray = NULL;
-    int width1, width2, height1, height2;
-    int format, components, jpegcs;
-    float diff;
-
-    // Set requested pixel format
     switch (method)
     {
     case MPE:
     case PSNR:
     case MSE:
     case MSEF:
-        format = JCS_RGB;
-        components = 3;
-        break;
-    case SSIM:
-    case MS_SSIM:
-    case VIFP1:
-    case SMALLFRY:
-    case SHARPENBAD:
-    case COR:
-    case NHW:
+        return 3;
     default:
-        format = JCS_GRAYSCALE;
-        components = 1;
-        break;
+        return 1;
     }
+}
+
+// Reference of a comparison, decoded and prepared once for all methods
+typedef struct
+{
+    const int *methods;
+    int methodCount, size;
+    int useRgb, useGray, useHash;
+    int width, height;
+    unsigned char *image, *gray;
+    uint64_t *hash;
+    metric_context ctx[METHOD_COUNT];
+} compare_reference;
+
+// One candidate, decoded once for all the methods that score it
+typedef struct
+{
+    const compare_reference *ref;
+    compare_candidate *candidate;
+    unsigned char *image, *gray;
+    uint64_t *hash;
+} compare_decoded;
+
+// One method scoring one decoded candidate
+typedef struct
+{
+    const compare_decoded *decoded;
+    int method;
+} compare_score;
+
+/*
+    Decode an image in the forms the methods use: RGB, luma or a hash.
+    RGB and luma come from a single decode, and luma is the decoder's own
+    as with a grayscale decode.
+*/
+static int compareDecode(const compare_reference *ref, unsigned char *buf, long bufSize, enum filetype type,
+                         unsigned char **image, unsigned char **gray, uint64_t **hash, int *width, int *height)
+{
+    unsigned long int size = 1;
+    int jpegcs;
+
+    *image = NULL;
+    *gray = NULL;
+    *hash = NULL;
+
+    if (ref->useGray)
+        size = decodeFileFromBufferGray(buf, bufSize, ref->useRgb ? image : NULL, gray, type, width, height, &jpegcs);
+    else if (ref->useRgb)
+        size = decodeFileFromBuffer(buf, bufSize, image, type, width, height, &jpegcs, JCS_RGB);
+
+    if (size && ref->useHash && jpegHashFromBuffer(buf, bufSize, hash, ref->size))
+        size = 0;
 
-    // Decode files
-    if (!decodeFileFromBuffer(imageBuf1, bufSize1, &image1, inputFiletype1, &width1, &height1, &jpegcs, format))
+    if (!size)
     {
-        error("invalid input reference file");
+        free(*image);
+        free(*gray);
+        *image = NULL;
+        *gray = NULL;
+    }
+
+    return !size;
+}
+
+static void runDecode(void *arg)
+{
+    compare_decoded *d = arg;
+    compare_candidate *c = d->candidate;
+    int width, height;
+
+    if (!c->bufSize || compareDecode(d->ref, c->buf, c->bufSize, c->filetype, &d->image, &d->gray, &d->hash, &width, &height))
+        c->status = COMPARE_DECODE;
+    else if ((d->ref->useRgb || d->ref->useGray) && (width != d->ref->width || height != d->ref->height))
+        c->status = COMPARE_SIZE;
+    else
+        c->status = COMPARE_OK;
+}
+
+static void runScore(void *arg)
+{
+    compare_score *score = arg;
+    const compare_decoded *d = score->decoded;
+    const compare_reference *ref = d->ref;
+    int bits = ref->size * ref->size;
+
+    if (d->candidate->status != COMPARE_OK)
+        return;
+
+    if (score->method == FAST)
+        d->candidate->diff[FAST] = (float) (hammingDist(ref->hash, d->hash, bits) * 100 / bits);
+    else
+        d->candidate->diff[score->method] = MetricCalcPrepared(&ref->ctx[score->method], compareComponents(score->method) == 3 ? d->image : d->gray);
+}
+
+int compareManyFromBuffer(const int *methods, int methodCount, int size, unsigned char *refBuf, long refSize, enum filetype refFiletype,
+                          compare_candidate *candidates, int count, int threads)
+{
+    compare_reference ref;
+    compare_decoded *decoded;
+    compare_score *scores;
+    int first, group, x, m;
+
+    ref.methods = methods;
+    ref.methodCount = methodCount;
+    ref.size = size;
+    ref.useRgb = ref.useGray = ref.useHash = 0;
+    for (m = 0; m < methodCount; m++)
+    {
+        if (methods[m] == FAST)
+            ref.useHash = 1;
+        else if (compareComponents(methods[m]) == 3)
+            ref.useRgb = 1;
+        else
+            ref.useGray = 1;
+    }
+
+    if (compareDecode(&ref, refBuf, refSize, refFiletype, &ref.image, &ref.gray, &ref.hash, &ref.width, &ref.height))
         return 1;
+
+    for (m = 0; m < methodCount; m++)
+    {
+        if (methods[m] != FAST)
+            MetricPrepare(&ref.ctx[methods[m]], methods[m], compareComponents(methods[m]) == 3 ? ref.image : ref.gray,
+                          ref.width, ref.height, compareComponents(methods[m]));
     }
 
-    if (1 == components && FILETYPE_PPM == inputFiletype1)
+    // Candidates go a group at a time, as many as there are threads, so
+    // that only that many are held decoded. Each group is decoded side
+    // by side, then all its methods are scored side by side.
+    threads = MAX(1, MIN(threads, MAX_THREADS));
+    decoded = malloc(threads * sizeof(compare_decoded));
+    scores = malloc((size_t) threads * MAX(methodCount, 1) * sizeof(compare_score));
+
+    for (first = 0; first < count; first += group)
     {
-        grayscale(image1, &image1Gray, width1, height1);
-        free(image1);
-        image1 = image1Gray;
+        group = MIN(threads, count - first);
+
+        for (x = 0; x < group; x++)
+        {
+            decoded[x].ref = &ref;
+            decoded[x].candidate = &candidates[first + x];
+            decoded[x].image = decoded[x].gray = NULL;
+            decoded[x].hash = NULL;
+        }
+        parallelRun(runDecode, decoded, sizeof(compare_decoded), group, threads);
+
+        for (x = 0; x < group; x++)
+        {
+            for (m = 0; m < methodCount; m++)
+            {
+                scores[x * methodCount + m].decoded = &decoded[x];
+                scores[x * methodCount + m].method = methods[m];
+            }
+        }
+        parallelRun(runScore, scores, sizeof(compare_score), group * methodCount, threads);
+
+        for (x = 0; x < group; x++)
+        {
+            free(decoded[x].image);
+            free(decoded[x].gray);
+            free(decoded[x].hash);
+        }
     }
 
-    if (!decodeFileFromBuffer(imageBuf2, bufSize2, &image2, inputFiletype2, &width2, &height2, &jpegcs, format))
+    free(scores);
+    free(decoded);
+    free(ref.image);
+    free(ref.gray);
+    free(ref.hash);
+
+    return 0;
+}
+
+int compareFromBuffer(int method, unsigned char *imageBuf1, long bufSize1, unsigned char *imageBuf2, long bufSize2, int printPrefix, int umscale, enum filetype inputFiletype1, enum filetype inputFiletype2)
+{
+    compare_candidate candidate;
+    float diff;
+
+    candidate.buf = imageBuf2;
+    candidate.bufSize = bufSize2;
+    candidate.filetype = inputFiletype2;
+
+    // Decode files and calculate the comparison
+    if (compareManyFromBuffer(&method, 1, 16, imageBuf1, bufSize1, inputFiletype1, &candidate, 1, 1))
     {
-        error("invalid input query file");
+        error("invalid input reference file");
         return 1;
     }
 
-    if (1 == components && FILETYPE_PPM == inputFiletype2)
+    if (candidate.status == COMPARE_DECODE)
     {
-        grayscale(image2, &image2Gray, width2, height2);
-        free(image2);
-        image2 = image2Gray;
+        error("invalid input query file");
+        return 1;
     }
 
     // Ensure width/height are equal
-    if (width1 != width2 || height1 != height2)
+    if (candidate.status == COMPARE_SIZE)
     {
         error("images must be identical sizes for selected method!");
         return 1;
     }
 
-    // Calculate and print comparison
-    diff = MetricCalc(method, image1, image2, width1, height1, components);
+    // Print comparison
+    diff = candidate.diff[method];
     if (umscale)
         diff = MetricRescale(method, diff);
     if (printPrefix)
@@ -1247,9 +4460,5 @@ int compareFromBuffer(int method, unsigned char *imageBuf1, long bufSize1, unsig
     else
         printf("\n");
 
-    // Cleanup
-    free(image1);
-    free(image2);
-
     return 0;
 }
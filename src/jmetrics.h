@@ -7,7 +7,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <setjmp.h>
 #include <sys/types.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <jpeglib.h>
 #include <iqa.h>
 #include <smallfry.h>
@@ -27,6 +30,9 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+// Upper bound on worker threads used by any parallel stage
+#define MAX_THREADS 64
+
 // Subsampling method, which defines how much of the data from
 // each color channel is included in the image per 2x2 block.
 // A value of 4 means all four pixels are included, while 2
@@ -39,7 +45,9 @@ enum SUBSAMPLING_METHOD
     SUBSAMPLE_DEFAULT,
     // Using 4:4:4 is more detailed and will prevent fine text
     // from getting blurry (e.g. screenshots)
-    SUBSAMPLE_444
+    SUBSAMPLE_444,
+    // 4:2:2 halves the chroma horizontally only
+    SUBSAMPLE_422
 };
 
 enum filetype
@@ -71,6 +79,19 @@ enum METHOD
     SUMMET
 };
 
+#define METHOD_COUNT (SUMMET + 1)
+
+// Quality search strategy
+enum SEARCH_STRATEGY
+{
+    // Plain bisection of the quality interval
+    SEARCH_BISECT,
+    // Interpolate the target crossing between the bracket edges
+    SEARCH_SECANT,
+    // Secant steps that fall back to bisection when they stall
+    SEARCH_HYBRID
+};
+
 // Target quality (SSIM) value
 enum QUALITY_PRESET
 {
@@ -84,7 +105,11 @@ enum QUALITY_PRESET
 /* Long command line options. */
 enum longopts
 {
-    OPT_SHORT = 1000
+    OPT_SHORT = 1000,
+    OPT_NOSEED,
+    OPT_SEARCH,
+    OPT_SAMPLE,
+    OPT_JSON
 };
 
 /*
@@ -97,6 +122,31 @@ float clamp(float low, float value, float high);
 */
 int interpolate(const unsigned char *image, int width, int components, float x, float y, int offset);
 
+/*
+    Integer kernels behind the pixel metrics: the sums of absolute and
+    of squared differences of two buffers, and the sum and sum of
+    squares of both. They accumulate in 64 bits, so they are exact at
+    any image size. SSE2, AVX2 or AVX-512 versions are picked at runtime
+    from the CPU features, and the scalar ones are the reference.
+    simdSelect limits the level, for testing; it returns the one in use.
+    Buffers of several megabytes are split into bands that are summed on
+    the MetricSetThreads threads, in a layout set by the size alone, so
+    the sums are the same for any thread count.
+*/
+enum SIMD_LEVEL
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+int simdLevel(void);
+int simdSelect(int level);
+uint64_t pixelSad(const unsigned char *a, const unsigned char *b, size_t n);
+uint64_t pixelSsd(const unsigned char *a, const unsigned char *b, size_t n);
+void pixelMoments(const unsigned char *a, const unsigned char *b, size_t n, uint64_t *sum, uint64_t *sumSq);
+
 /*
     Get mean error per pixel rate.
 */
@@ -113,19 +163,45 @@ float metric_msef(const unsigned char *ref, const unsigned char *cmp, int width,
 */
 void defish(const unsigned char *input, unsigned char *output, int width, int height, int components, float strength, float zoom);
 
+/*
+    The remap behind defish, for reuse across images of the same size
+    from the same lens. The distortion only depends on the distance to
+    the center, so its angle ratio is kept for one quadrant and mirrored
+    to the others; sqrt and atan run once per quadrant pixel instead of
+    per image pixel. defishMapped splits the rows over threads and gives
+    the same output as defish.
+*/
+typedef struct
+{
+    int width, height;
+    float strength, zoom;
+    int quadWidth, quadHeight;
+    float *theta;
+} defish_map;
+
+int defishMapInit(defish_map *m, int width, int height, float strength, float zoom);
+void defishMapFree(defish_map *m);
+void defishMapped(const defish_map *m, const unsigned char *input, unsigned char *output, int components, int threads);
+
 /*
     Convert an RGB image to grayscale. Assumes 8-bit color components,
-    3 color components and a row stride of width * 3.
+    3 color components and a row stride of width * 3. Y is computed in
+    fixed point with the weights of libjpeg, so it is the Y plane a JPEG
+    encoder makes, on the SIMD kernels when the CPU has them.
+    grayscaleInto writes into a buffer of width * height bytes.
 */
 unsigned long int grayscale(const unsigned char *input, unsigned char **output, int width, int height);
+void grayscaleInto(const unsigned char *input, unsigned char *output, int width, int height);
 
 /*
     Generate an image hash given a filename. This is a convenience
     function which reads the file, decodes it to grayscale,
-    scales the image, and generates the hash.
+    scales the image, and generates the hash. The JPEG is decoded at
+    down to 1/8 size by DCT scaling, then averaged down to size x size.
+    The hash is packed as described for genHash.
 */
-int jpegHash(const char *filename, unsigned char **hash, int size);
-int jpegHashFromBuffer(unsigned char *imageBuf, long bufSize, unsigned char **hash, int size);
+int jpegHash(const char *filename, uint64_t **hash, int size);
+int jpegHashFromBuffer(unsigned char *imageBuf, long bufSize, uint64_t **hash, int size);
 
 /*
     Downscale an image with nearest-neighbor interpolation.
@@ -133,17 +209,88 @@ int jpegHashFromBuffer(unsigned char *imageBuf, long bufSize, unsigned char **ha
 */
 void scale(unsigned char *image, int width, int height, unsigned char **newImage, int newWidth, int newHeight);
 
+/*
+    Shrink a grayscale image to any smaller size, averaging the pixels
+    that fall in each output pixel. Sizes must not grow.
+*/
+void areaScale(const unsigned char *image, int width, int height, unsigned char **newImage, int newWidth, int newHeight);
+
+/*
+    Shrink an image by an integer factor, averaging each factor x factor
+    block of pixels. Partial blocks at the right and bottom edges average
+    the pixels they have. Returns the number of output pixels.
+*/
+unsigned long int downscale(const unsigned char *input, unsigned char **output, int width, int height, int components, int factor, int *newWidth, int *newHeight);
+
+/*
+    Pick about percent of the whole tile x tile squares of an RGB image,
+    in proportion from flat, varied and edge tiles by their luma, spread
+    over the image, and pack them into a new image of whole tiles.
+    Returns the number of sampled pixels, or 0 if no tile fits.
+*/
+unsigned long int sampleTiles(const unsigned char *input, const unsigned char *gray, int width, int height, int tile, int percent, unsigned char **output, int *newWidth, int *newHeight);
+
 /*
     Generate an image hash based on gradients.
     http://www.hackerfactor.com/blog/index.php?/archives/529-Kind-of-Like-That.html
+    Bit k, set when pixel k is darker than the next one in its row, is
+    bit k % 64 of word k / 64; the last pixel of a row is compared with
+    the first. The hash takes HASH_WORDS(width * height) words and the
+    bits past the end are zero.
 */
-void genHash(unsigned char *image, int width, int height, unsigned char **hash);
+#define HASH_WORDS(bits) (((bits) + 63) / 64)
+
+void genHash(const unsigned char *image, int width, int height, uint64_t **hash);
 
 /*
-    Calculate the hamming distance between two hashes.
+    Calculate the hamming distance between two packed hashes of
+    hashLength bits, a word at a time with POPCNT where the CPU has it.
     http://en.wikipedia.org/wiki/Hamming_distance
 */
-unsigned int hammingDist(const unsigned char *hash1, const unsigned char *hash2, int hashLength);
+unsigned int hammingDist(const uint64_t *hash1, const uint64_t *hash2, int hashLength);
+
+/*
+    Multi-index hashing of packed hashes of the same length, to find
+    every hash within a Hamming distance of a query without comparing
+    them all. The hashes are split into parts of up to 20 bits, sized
+    to the number of entries, and a table for each part lists the
+    entries by the value of that part. A hash within radius of the query has
+    some part within radius / parts of the query's, so only those
+    buckets are looked in, unless there are more of them than entries.
+    Entries are numbered in the order they are added. hashIndexBuild
+    makes the tables after adding; until then queries compare against
+    every entry. hashIndexQuery returns the number of entries within
+    radius bits and a list of them, in increasing order, that the
+    caller frees. Only the hashes are saved; loading builds the tables.
+    Saving and loading return 0 on success.
+*/
+typedef struct
+{
+    int bits, words, parts;
+    int count, capacity, built;
+    uint64_t *hashes;
+    int *firsts, *offsets, *entries;
+} hash_index;
+
+void hashIndexInit(hash_index *idx, int bits);
+void hashIndexFree(hash_index *idx);
+int hashIndexAdd(hash_index *idx, const uint64_t *hash);
+void hashIndexBuild(hash_index *idx);
+int hashIndexQuery(const hash_index *idx, const uint64_t *hash, int radius, int **matches);
+int hashIndexSave(const hash_index *idx, FILE *file);
+int hashIndexLoad(hash_index *idx, FILE *file);
+
+/*
+    Run count independent jobs on up to threads worker threads.
+    Job i receives (char *)args + i * argSize. Jobs are dealt out to
+    threads round-robin, so every job writes only its own slot and
+    the results never depend on scheduling.
+*/
+typedef void (*parallel_job)(void *arg);
+void parallelRun(parallel_job job, void *args, size_t argSize, int count, int threads);
+
+/* Number of online CPUs, at least 1. */
+int cpuCount(void);
 
 /* Print program version to stdout. */
 void version(void);
@@ -176,6 +323,108 @@ unsigned long int decodePpm(unsigned char *buf, unsigned long int bufSize, unsig
 */
 unsigned long int encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int jpegcs, int progressive, int optimize, int subsample);
 
+/*
+    Color converted and downsampled planes of an RGB image, prepared once
+    for jpegcs and subsample and fed to libjpeg as raw data on every
+    encode. Planes cover whole MCUs, with the edges replicated, and the
+    arithmetic follows libjpeg so the output is the same as encodeJpeg's.
+    libjpeg 7 and later instead downsample chroma in encodeJpeg with
+    scaled DCTs, which raw data cannot use, so there only 4:4:4 output
+    is the same. Supports YCbCr, grayscale and RGB output.
+*/
+typedef struct
+{
+    int width, height, jpegcs, subsample, components;
+    int maxHSamp, maxVSamp, paddedWidth, paddedHeight;
+    int hSamp[3], vSamp[3], planeWidth[3], planeHeight[3];
+    unsigned char *plane[3];
+} jpeg_planes;
+
+int planesInit(jpeg_planes *p, const unsigned char *rgb, int width, int height, int jpegcs, int subsample);
+void planesFree(jpeg_planes *p);
+
+/* Encode prepared planes. With lumaOnly only Y is written, as grayscale. */
+unsigned long int encodeJpegPlanes(unsigned char **jpeg, const jpeg_planes *p, int quality, int progressive, int optimize, int lumaOnly);
+
+/*
+    Transcoding engine for JPEG sources. The DCT coefficients are read
+    once, and every trial quality is produced by requantizing them with
+    the new quantization tables, which skips color conversion, chroma
+    downsampling and the forward DCT. The source sampling and color
+    space are kept. Table entries finer than the source ones are not
+    used, so a trial never asks for more precision than the source has.
+    With lumaOnly set only the first component is written, as grayscale.
+*/
+typedef struct
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    jvirt_barray_ptr *coefs;
+} jpeg_transcoder;
+
+int transcoderInit(jpeg_transcoder *tc, unsigned char *buf, unsigned long bufSize);
+void transcoderFree(jpeg_transcoder *tc);
+unsigned long int transcodeJpeg(jpeg_transcoder *tc, unsigned char **jpeg, int quality, int progressive, int optimize, int lumaOnly);
+
+/* AC Huffman statistics and error of the whole blocks of a scored trial. */
+typedef struct
+{
+    unsigned long int acFreq[256];
+    int64_t acBits, error64, energy;
+    int known;
+} dct_totals;
+
+/*
+    Trial engine that never writes a bitstream. The Y plane goes through
+    the forward DCT once; a trial quantizes the blocks with the standard
+    luma table for its quality, counts the Huffman symbols of a baseline
+    scan to size it, and rebuilds the luma a decoder would show with the
+    inverse DCT. The DCTs are libjpeg's integer ones, so the luma is the
+    same as decoding encodeJpegPlanes(..., lumaOnly) output, and the size
+    is the same up to the zero bytes stuffed after 0xFF in the scan.
+    Supports YCbCr and grayscale planes.
+*/
+typedef struct
+{
+    int width, height, blocksWide, blocksHigh;
+    int16_t *coefs;
+    dct_totals *totals;
+    unsigned char dcLength[256], acLength[256];
+    int dcSymbols, acSymbols;
+    unsigned char limit[1024];
+    const unsigned char *reference;
+    uint64_t mismatch, refSum, refSumSq;
+} jpeg_dct_luma;
+
+int dctLumaInit(jpeg_dct_luma *d, const jpeg_planes *p);
+void dctLumaFree(jpeg_dct_luma *d);
+
+/* Luma of a trial at quality into a new gray image, returns the size. */
+unsigned long int dctLumaTrial(jpeg_dct_luma *d, int quality, int optimize, unsigned char **gray);
+
+/*
+    MSE, PSNR and MSEF of trials straight from the coefficients. The DCT
+    is orthonormal up to a scale, so the squared error of a whole block
+    is that of its coefficients, and its sums come from the dequantized
+    DC and AC. Blocks cut by the image edge are rebuilt and compared as
+    pixels. The coefficients are those of the Y plane, so the error
+    between it and gray, the reference luma the metric is against, is
+    added once, and so is the expected error of rounding the decoded
+    pixels. Clamping is left out, so the result is close to but not the
+    same as MetricCalc on the decoded luma. dctLumaScored tells if a
+    method can be scored.
+
+    A score is updated block by block from the one at quality from, if
+    that was scored before, 0 for none. Neighbouring qualities often
+    share the DC step and the low AC steps, so flat and smooth blocks
+    keep their AC and only the changed ones are requantized. Scores of
+    distinct qualities can run side by side, as long as from was scored
+    before any of them started.
+*/
+void dctLumaReference(jpeg_dct_luma *d, const jpeg_planes *p, const unsigned char *gray);
+int dctLumaScored(int method);
+unsigned long int dctLumaScore(jpeg_dct_luma *d, int method, int quality, int from, int optimize, float *metric);
+
 /* Automatically detect the file type of a given file. */
 enum filetype detectFiletype(const char *filename);
 enum filetype detectFiletypeFromBuffer(unsigned char *buf, unsigned long int bufSize);
@@ -184,6 +433,15 @@ enum filetype detectFiletypeFromBuffer(unsigned char *buf, unsigned long int buf
 unsigned long int decodeFile(const char *filename, unsigned char **image, enum filetype type, int *width, int *height, int pixelFormat);
 unsigned long int decodeFileFromBuffer(unsigned char *buf, unsigned long int bufSize, unsigned char **image, enum filetype type, int *width, int *height, int *jpegcs, int pixelFormat);
 
+/*
+    Decode an image file to its luma and, unless image is NULL, to RGB.
+    YCbCr and grayscale JPEGs give the Y samples of the decoder itself,
+    with no color conversion back and forth, and when only luma is asked
+    for the chroma is not even upsampled. Other images get grayscale()
+    luma, JPEG rows converted as they are decoded.
+*/
+unsigned long int decodeFileFromBufferGray(unsigned char *buf, unsigned long int bufSize, unsigned char **image, unsigned char **gray, enum filetype type, int *width, int *height, int *jpegcs);
+
 /*
     Get JPEG metadata (EXIF, IPTC, XMP, etc) and return a buffer
     with just this data, suitable for writing out to a new file.
@@ -195,6 +453,27 @@ unsigned long int decodeFileFromBuffer(unsigned char *buf, unsigned long int buf
     modified the file.
 */
 int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **meta, unsigned int *metaSize, const char *comment);
+
+/*
+    Header-only view of a JPEG file: markers up to the first SOS are
+    scanned without any entropy decoding. Quantization tables are kept
+    in natural order. quality is the IJG quality whose scaled standard
+    luma table is nearest to the one used by the first component, or 0
+    if that table is missing.
+*/
+typedef struct
+{
+    int width, height, components, precision, progressive;
+    int quantTable[4];
+    int quantDefined[4];
+    unsigned int quant[4][DCTSIZE2];
+    int quality;
+    int processed;
+} jpeg_header;
+
+int scanJpegHeader(const unsigned char *buf, unsigned long int bufSize, jpeg_header *header, const char *comment);
+int estimateJpegQuality(const unsigned int *quant, int chroma);
+
 FILE *openOutput(char *name);
 void info(int quiet, const char *format, ...);
 
@@ -203,12 +482,149 @@ int parseSubsampling(const char *s);
 enum QUALITY_PRESET parseQuality(const char *s);
 float setTargetFromPreset(int preset);
 enum METHOD parseMethod(const char *s);
+
+/*
+    Parse a comma separated list of methods, or 'all' for every method
+    but FAST, into methods, which has room for METHOD_COUNT. Methods
+    named twice count once. Returns the number of methods, or 0 if one
+    is unknown.
+*/
+int parseMethods(const char *s, int *methods);
 float MetricRescale(int currentmethod, float value);
 char* MetricName(int currentmethod);
 float MetricCalc(int method, unsigned char *image1, unsigned char *image2, int width, int height, int components);
+
+/*
+    The components of SUMMET, SSIMFRY and SSIMSHBAD, and the bands of
+    the pixel kernels, are computed side by side on up to
+    MetricSetThreads threads, 0 - all CPUs [0]. The scores do not depend
+    on the thread count.
+*/
+void MetricSetThreads(int threads);
+
+/*
+    Metric of a fixed reference image, prepared once for comparing many
+    candidates against it, as a search does. Quantities that depend on
+    the reference alone are computed by MetricPrepare; so far these are
+    the reference sums of MSEF, other methods fall back to MetricCalc.
+    MetricCalcPrepared gives the same value as MetricCalc. The reference
+    is not copied and must outlive the context.
+*/
+typedef struct
+{
+    int method;
+    unsigned char *reference;
+    int width, height, components;
+    int prepared;
+    uint64_t sum, sumSq;
+} metric_context;
+
+void MetricPrepare(metric_context *ctx, int method, unsigned char *reference, int width, int height, int components);
+float MetricCalcPrepared(const metric_context *ctx, unsigned char *compressed);
 float MetricSigma(float cor);
 int compareFastFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char *imageBuf2, long bufSize2, int printPrefix, int size);
 int compareFromBuffer(int method, unsigned char *imageBuf1, long bufSize1, unsigned char *imageBuf2, long bufSize2, int printPrefix, int umscale, enum filetype inputFiletype1, enum filetype inputFiletype2);
+
+/*
+    Compare one reference with many candidates by one or more methods.
+    Every image is decoded once for all the methods, to RGB and luma as
+    they need, and hashed at size for FAST. The reference is prepared
+    once for each method, and the candidates are decoded and scored
+    against it on up to threads threads. Each candidate gets diff[method]
+    for every method, as MetricCalc or the FAST percentage gives it, or a
+    status saying why it has none; an empty buffer counts as
+    undecodable, and sizes must match unless FAST is the only method.
+    Returns 1 if the reference cannot be decoded.
+*/
+enum COMPARE_STATUS
+{
+    COMPARE_OK,
+    COMPARE_DECODE,
+    COMPARE_SIZE
+};
+
+typedef struct
+{
+    unsigned char *buf;
+    long bufSize;
+    enum filetype filetype;
+    float diff[METHOD_COUNT];
+    int status;
+} compare_candidate;
+
+int compareManyFromBuffer(const int *methods, int methodCount, int size, unsigned char *refBuf, long refSize, enum filetype refFiletype,
+                          compare_candidate *candidates, int count, int threads);
 float waverage(float *x, int count);
 
+/*
+    Search seeding from the source quality. qualityPrior gives how many
+    quality steps below the source the target UM usually lands for a
+    method, scaled from the medium preset. seedQualityRange narrows
+    [min, max] around that guess; bias moves the guess down further for
+    encoders with a different quality scale.
+*/
+int qualityPrior(int method, float target);
+void seedQualityRange(int method, float target, int sourceQuality, int bias, int *min, int *max);
+
+/*
+    Search for the lowest quality whose UM reaches the target. [min, max]
+    always brackets the answer: a trial below the target raises min, any
+    other lowers max, whatever strategy picked it. An edge is known once
+    a trial confirmed it, and its UM is kept for the secant model.
+*/
+typedef struct
+{
+    int strategy;
+    float target;
+    int min, max;
+    int minKnown, maxKnown;
+    float minMetric, maxMetric;
+    // Bracket width before the last step and which edge it moved
+    int width, lastSide;
+    // Trials left, which model steps must leave enough of to bisect
+    int steps;
+} quality_search;
+
+enum SEARCH_STRATEGY parseSearch(const char *s);
+void searchInit(quality_search *qs, int strategy, float target, int min, int max);
+
+/*
+    Next quality to try, also the best guess once the search is done.
+    Model steps never leave a bracket that bisection could not narrow
+    down in the trials left, so with steps trials any strategy ends at
+    least as narrow as plain bisection. searchInit gives the steps
+    bisection needs to finish; a caller with a fixed budget sets steps.
+*/
+int searchNext(const quality_search *qs);
+void searchUpdate(quality_search *qs, int quality, float metric);
+
+/* Nothing left to try inside the bracket. */
+int searchDone(const quality_search *qs);
+
+/* Number of bisection steps that narrow the bracket down to one quality. */
+int searchSteps(const quality_search *qs);
+
+/*
+    Reopen an edge of a finished search that no trial confirmed, up to
+    lowest or highest, and raise attempt so the reopened range can still
+    be bisected to the end. Returns 1 if the bracket changed.
+*/
+int searchWiden(quality_search *qs, int lowest, int highest, int *attempt);
+
+/*
+    Keep a model step at quality inside the part of (min, max) from which
+    the bracket it leaves can still be bisected, in steps - 1 more trials,
+    down to the width plain bisection would reach. Gives the bisection
+    point when there is no room left for anything else.
+*/
+int searchClamp(int min, int max, int quality, int steps);
+
+/*
+    Model step for searches that look for a maximum instead of a target
+    crossing: the vertex of the parabola through three points, rounded
+    and kept strictly inside (min, max). Returns 0 when the points do not
+    describe a maximum inside the bracket.
+*/
+int searchVertex(int min, int max, const int *x, const float *y, int *vertex);
+
 #endif
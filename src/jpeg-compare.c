@@ -13,32 +13,338 @@
     and white edit) or just slightly different images. It is possible
     to get false positives, in which case a slower PSNR or SSIM
     comparison will help.
+
+    Given more than two images, the first is the reference and each of
+    the others is compared with it, on several threads, with the
+    reference decoded only once. A manifest lists pairs instead, one
+    reference and one candidate to a line.
+
+    Several methods, or all but FAST, can be given at once. Each image
+    is then decoded only once for all of them, and every pair prints a
+    table of the raw and UM values of each method, or a line of JSON.
 */
 
 #include <getopt.h>
 #include "jmetrics.h"
 
+// Candidates of one reference, with the names they are printed by
+typedef struct
+{
+    char *reference;
+    char **names;
+    compare_candidate *candidates;
+    int count, capacity;
+} compare_batch;
+
+// How pairs are compared and printed
+typedef struct
+{
+    int methods[METHOD_COUNT];
+    int methodCount, size, threads;
+    int printPrefix, umscale, json;
+    enum filetype inputFiletype1, inputFiletype2;
+} compare_options;
+
 void usage(char *progname)
 {
-    printf("usage: %s [options] image1.jpg image2.jpg\n\n", progname);
+    printf("usage: %s [options] image1.jpg image2.jpg\n", progname);
+    printf("       %s [options] reference.jpg candidate.jpg [candidate.jpg ...]\n", progname);
+    printf("       %s [options] --manifest pairs.txt\n\n", progname);
     printf("options:\n\n");
     printf("  -h, --help                   output program help\n");
+    printf("  -j, --threads [arg]          compare candidates on N threads, 0 - all CPUs [0]\n");
+    printf("  -M, --manifest [arg]         compare the pairs of files listed in a file, one reference and\n");
+    printf("                               one candidate to a line, separated by a tab\n");
     printf("  -m, --method [arg]           set comparison method to one of:\n");
     printf("                               'fast', 'mpe', 'psnr', 'mse', 'msef', 'cor', 'ssim', 'ms-ssim', 'vifp1',\n");
-    printf("                               'smallfry', 'shbad', 'nhw', 'ssimfry', 'ssimshb', 'sum' [fast]\n");
+    printf("                               'smallfry', 'shbad', 'nhw', 'ssimfry', 'ssimshb', 'sum' [fast],\n");
+    printf("                               a comma separated list of them, or 'all' but 'fast'\n");
     printf("  -n, --norm                   UM scale metric\n");
     printf("  -r, --ppm                    parse first input as PPM instead of JPEG\n");
     printf("  -s, --size [arg]             set fast comparison image hash size\n");
     printf("  -T, --input-filetype [arg]   set first input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
     printf("  -U, --second-filetype [arg]  set second input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
     printf("  -V, --version                output program version\n");
+    printf("      --json                   print a line of JSON for each pair of images\n");
     printf("      --short                  do not prefix output with the name of the used method\n");
 }
 
+static void addCandidate(compare_batch *batch, char *name)
+{
+    if (batch->count == batch->capacity)
+    {
+        batch->capacity = MAX(16, batch->capacity * 2);
+        batch->names = realloc(batch->names, batch->capacity * sizeof(char *));
+        batch->candidates = realloc(batch->candidates, batch->capacity * sizeof(compare_candidate));
+    }
+
+    batch->names[batch->count] = name;
+    batch->candidates[batch->count].buf = NULL;
+    batch->candidates[batch->count].bufSize = 0;
+    batch->count++;
+}
+
+static void emptyBatch(compare_batch *batch, unsigned char *refBuf)
+{
+    int x;
+
+    for (x = 0; x < batch->count; x++)
+    {
+        if (batch->candidates[x].bufSize)
+            free(batch->candidates[x].buf);
+    }
+    free(refBuf);
+    batch->count = 0;
+}
+
+static void printJsonString(const char *s)
+{
+    putchar('"');
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+// JSON has no infinity, which PSNR gives for identical images
+static void printJsonNumber(const char *format, float value)
+{
+    if (isfinite(value))
+        printf(format, value);
+    else
+        printf("null");
+}
+
+/*
+    Print the scores of one pair. One method prints a line as for two
+    images, several a table row of the raw and UM value of each, and
+    JSON a line with both for every method and the names of the pair.
+    Otherwise names gives the names lines start with: none, the
+    candidate, or the reference and the candidate.
+*/
+static void printScores(const compare_options *opts, const char *reference, const char *name, int names,
+                        const compare_candidate *c)
+{
+    int x, method;
+    float diff;
+
+    if (opts->json)
+    {
+        printf("{\"reference\": ");
+        printJsonString(reference);
+        printf(", \"candidate\": ");
+        printJsonString(name);
+        printf(", \"metrics\": {");
+        for (x = 0; x < opts->methodCount; x++)
+        {
+            method = opts->methods[x];
+            printf("%s\"%s\": {\"value\": ", x ? ", " : "", MetricName(method));
+            printJsonNumber(method == FAST ? "%.0f" : "%f", c->diff[method]);
+            printf(", \"um\": ");
+            printJsonNumber("%f", MetricRescale(method, c->diff[method]));
+            printf("}");
+        }
+        printf("}}\n");
+        return;
+    }
+
+    for (x = 0; x < opts->methodCount; x++)
+    {
+        method = opts->methods[x];
+
+        if (names > 1)
+            printf("%s\t", reference);
+        if (names)
+            printf("%s\t", name);
+
+        if (opts->methodCount > 1)
+        {
+            printf(method == FAST ? "%s\t%.0f\t%f\n" : "%s\t%f\t%f\n", MetricName(method), c->diff[method],
+                   MetricRescale(method, c->diff[method]));
+            continue;
+        }
+
+        if (opts->printPrefix)
+            printf("%s: ", MetricName(method));
+
+        if (method == FAST)
+        {
+            printf("%u\n", (unsigned int) c->diff[method]);
+            continue;
+        }
+
+        diff = opts->umscale ? MetricRescale(method, c->diff[method]) : c->diff[method];
+        printf("%f", diff);
+        if (opts->umscale)
+            printf(" (UM)\n");
+        else
+            printf("\n");
+    }
+}
+
+/*
+    Compare the candidates of a batch with its reference and print the
+    scores of each, with the names given by names: none, the candidate,
+    or both. The batch is emptied. Returns 1 if anything could not be
+    compared.
+*/
+static int runBatch(compare_batch *batch, const compare_options *opts, int names)
+{
+    compare_candidate *c;
+    unsigned char *refBuf;
+    enum filetype inputFiletype1 = opts->inputFiletype1;
+    long refSize;
+    int x, fast = 0, ret = 0;
+
+    for (x = 0; x < opts->methodCount; x++)
+        fast = fast || opts->methods[x] == FAST;
+
+    refSize = readFile(batch->reference, (void **) &refBuf);
+    if (!refSize)
+    {
+        error("failed to read file: %s", batch->reference);
+        batch->count = 0;
+        return 1;
+    }
+
+    if (inputFiletype1 == FILETYPE_AUTO)
+        inputFiletype1 = detectFiletypeFromBuffer(refBuf, refSize);
+
+    if (fast && inputFiletype1 != FILETYPE_JPEG)
+    {
+        error("fast comparison only works with JPEG files!");
+        emptyBatch(batch, refBuf);
+        return 1;
+    }
+
+    for (x = 0; x < batch->count; x++)
+    {
+        c = &batch->candidates[x];
+        c->bufSize = readFile(batch->names[x], (void **) &c->buf);
+        if (!c->bufSize)
+        {
+            error("failed to read file: %s", batch->names[x]);
+            continue;
+        }
+
+        c->filetype = (opts->inputFiletype2 == FILETYPE_AUTO) ? detectFiletypeFromBuffer(c->buf, c->bufSize) : opts->inputFiletype2;
+        if (fast && c->filetype != FILETYPE_JPEG)
+        {
+            error("fast comparison only works with JPEG files!");
+            free(c->buf);
+            c->bufSize = 0;
+        }
+    }
+
+    if (compareManyFromBuffer(opts->methods, opts->methodCount, opts->size, refBuf, refSize, inputFiletype1,
+                              batch->candidates, batch->count, opts->threads))
+    {
+        error("invalid input reference file: %s", batch->reference);
+        emptyBatch(batch, refBuf);
+        return 1;
+    }
+
+    for (x = 0; x < batch->count; x++)
+    {
+        c = &batch->candidates[x];
+
+        if (c->status == COMPARE_DECODE)
+        {
+            if (c->bufSize)
+                error("invalid input query file: %s", batch->names[x]);
+            ret = 1;
+            continue;
+        }
+
+        if (c->status == COMPARE_SIZE)
+        {
+            error("images must be identical sizes for selected method: %s", batch->names[x]);
+            ret = 1;
+            continue;
+        }
+
+        printScores(opts, batch->reference, batch->names[x], names, c);
+    }
+
+    emptyBatch(batch, refBuf);
+
+    return ret;
+}
+
+/*
+    Split a manifest into lines of a reference and a candidate separated
+    by a tab, skipping blank lines and # comments. Pairs that share a
+    reference on consecutive lines are compared as one batch.
+*/
+static int runManifest(char *manifest, const compare_options *opts)
+{
+    compare_batch batch = { 0 };
+    char *text, *line, *next, *tab, *end;
+    unsigned long int textSize;
+    int lineNumber = 0, ret = 0;
+
+    textSize = readFile(manifest, (void **) &text);
+    if (!textSize)
+    {
+        error("failed to read file: %s", manifest);
+        return 1;
+    }
+
+    text = realloc(text, textSize + 1);
+    text[textSize] = '\0';
+
+    for (line = text; line && *line; line = next)
+    {
+        lineNumber++;
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+
+        end = line + strlen(line);
+        if (end > line && end[-1] == '\r')
+            *--end = '\0';
+        if (!*line || *line == '#')
+            continue;
+
+        if (!(tab = strchr(line, '\t')))
+        {
+            error("invalid manifest line %d: %s", lineNumber, line);
+            ret = 1;
+            break;
+        }
+        *tab = '\0';
+
+        if (batch.count && strcmp(batch.reference, line))
+            ret = runBatch(&batch, opts, 2) || ret;
+
+        batch.reference = line;
+        addCandidate(&batch, tab + 1);
+    }
+
+    if (batch.count)
+        ret = runBatch(&batch, opts, 2) || ret;
+
+    free(batch.names);
+    free(batch.candidates);
+    free(text);
+
+    return ret;
+}
+
 int main (int argc, char **argv)
 {
     int method = FAST;
     int umscale = 0;
+    int json = 0;
+
+    int methods[METHOD_COUNT] = { FAST };
+    int methodCount = 1;
 
     int printPrefix = 1;
 
@@ -53,18 +359,28 @@ int main (int argc, char **argv)
     enum filetype inputFiletype1 = FILETYPE_AUTO;
     enum filetype inputFiletype2 = FILETYPE_AUTO;
 
-    const char *optstring = "VhS:m:nrT:U:";
+    // Many candidates: worker threads and an optional list of pairs
+    int threads = 0;
+    char *manifest = NULL;
+    compare_batch batch = { 0 };
+    compare_options copts;
+    int x, ret;
+
+    const char *optstring = "Vhs:j:M:m:nrT:U:";
     static const struct option opts[] =
     {
         { "version", no_argument, 0, 'V' },
         { "help", no_argument, 0, 'h' },
-        { "size", required_argument, 0, 'S' },
+        { "size", required_argument, 0, 's' },
+        { "threads", required_argument, 0, 'j' },
+        { "manifest", required_argument, 0, 'M' },
         { "method", required_argument, 0, 'm' },
         { "norm", no_argument, 0, 'n' },
         { "ppm", no_argument, 0, 'r' },
         { "input-filetype", required_argument, 0, 'T' },
         { "second-filetype", required_argument, 0, 'U' },
         { "short", no_argument, 0, OPT_SHORT },
+        { "json", no_argument, 0, OPT_JSON },
         { 0, 0, 0, 0 }
     };
     int opt, longind = 0;
@@ -84,8 +400,14 @@ int main (int argc, char **argv)
         case 's':
             size = atoi(optarg);
             break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'M':
+            manifest = optarg;
+            break;
         case 'm':
-            method = parseMethod(optarg);
+            methodCount = parseMethods(optarg, methods);
             break;
         case 'n':
             umscale = 1;
@@ -117,15 +439,61 @@ int main (int argc, char **argv)
         case OPT_SHORT:
             printPrefix = 0;
             break;
+        case OPT_JSON:
+            json = 1;
+            break;
         };
     }
 
-    if (argc - optind != 2)
+    if ((manifest && argc != optind) || (!manifest && argc - optind < 2) || size < 1)
     {
         usage(progname);
         return 255;
     }
 
+    if (!methodCount)
+    {
+        error("unknown comparison method!");
+        return 255;
+    }
+    method = methods[0];
+
+    // Several methods or JSON need the scores of all before printing
+    if (manifest || argc - optind > 2 || methodCount > 1 || json)
+    {
+        memcpy(copts.methods, methods, sizeof(methods));
+        copts.methodCount = methodCount;
+        copts.size = size;
+        copts.printPrefix = printPrefix;
+        copts.umscale = umscale;
+        copts.json = json;
+        copts.inputFiletype1 = inputFiletype1;
+        copts.inputFiletype2 = inputFiletype2;
+
+        if (threads < 1)
+            threads = cpuCount();
+        threads = MIN(threads, MAX_THREADS);
+
+        // Candidates share the CPUs with the metric bands inside each one
+        MetricSetThreads(MAX(1, cpuCount() / threads));
+        copts.threads = threads;
+
+        if (manifest)
+            return runManifest(manifest, &copts);
+
+        batch.reference = argv[optind];
+        for (x = optind + 1; x < argc; x++)
+            addCandidate(&batch, argv[x]);
+
+        // Two images print the scores alone, as without a batch
+        ret = runBatch(&batch, &copts, argc - optind > 2);
+
+        free(batch.names);
+        free(batch.candidates);
+
+        return ret;
+    }
+
     // Read the images
     fileName1 = argv[optind];
     fileName2 = argv[optind + 1];
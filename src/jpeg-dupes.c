@@ -0,0 +1,417 @@
+/*
+    Find near-duplicate JPEG images. Every JPEG under the given files
+    and directories is hashed as by jpeg-hash, on a pool of worker
+    threads, and the hashes are put in a multi-index hash table, so
+    that the images within a distance of any one are found without
+    comparing it to all of them.
+
+    The distance is the one jpeg-compare prints for its fast method, 0
+    for identical hashes up to 99. By default every pair of images
+    within the distance is printed, one per line, with their distance.
+    The hashes and the file names can be saved to an index, which later
+    runs read instead of hashing everything again, and which they can
+    add more files to.
+*/
+
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "jmetrics.h"
+
+// Hash of one file, made on a worker thread
+typedef struct
+{
+    const char *path;
+    int size;
+    uint64_t *hash;
+} hash_job;
+
+// File names in the order of the index entries
+typedef struct
+{
+    char **names;
+    int count, capacity;
+} name_list;
+
+// Directories being walked, to stop at links back up the tree
+typedef struct dir_parent
+{
+    dev_t dev;
+    ino_t ino;
+    const struct dir_parent *up;
+} dir_parent;
+
+void usage(char *progname)
+{
+    printf("usage: %s [options] [path ...]\n\n", progname);
+    printf("options:\n\n");
+    printf("  -d, --distance [arg]         largest distance to report, as jpeg-compare prints it [10]\n");
+    printf("  -h, --help                   output program help\n");
+    printf("  -i, --index [arg]            read hashes from an index made with --output\n");
+    printf("  -j, --threads [arg]          hash files on N threads, 0 - all CPUs [0]\n");
+    printf("  -o, --output [arg]           write the index to a file instead of listing pairs\n");
+    printf("  -q, --query [arg]            list the images near this one instead of all pairs\n");
+    printf("  -s, --size [arg]             set fast comparison image hash size [16]\n");
+    printf("  -V, --version                output program version\n");
+}
+
+static void addName(name_list *list, const char *name)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = MAX(16, list->capacity * 2);
+        list->names = realloc(list->names, list->capacity * sizeof(char *));
+    }
+
+    list->names[list->count] = malloc(strlen(name) + 1);
+    strcpy(list->names[list->count], name);
+    list->count++;
+}
+
+static void freeNames(name_list *list)
+{
+    int x;
+
+    for (x = 0; x < list->count; x++)
+        free(list->names[x]);
+    free(list->names);
+}
+
+static int isJpegName(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    const char *jpegExt[] = { ".jpg", ".jpeg", ".jpe", ".jfif" };
+    size_t x, c;
+
+    if (!ext)
+        return 0;
+
+    for (x = 0; x < sizeof(jpegExt) / sizeof(jpegExt[0]); x++)
+    {
+        for (c = 0; ext[c] && jpegExt[x][c] && (ext[c] | 0x20) == jpegExt[x][c]; c++);
+        if (!ext[c] && !jpegExt[x][c])
+            return 1;
+    }
+
+    return 0;
+}
+
+static int compareName(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+    Add the JPEG files under a directory to the list, recursively and
+    sorted by name, so that the order does not depend on the file
+    system. Files named on the command line are taken as they are.
+*/
+static void findFiles(name_list *list, const char *path, const dir_parent *up)
+{
+    name_list entries = { 0 };
+    struct dirent *entry;
+    struct stat st;
+    const dir_parent *p;
+    dir_parent self;
+    char *child;
+    DIR *dir;
+    int x;
+
+    if (stat(path, &st))
+    {
+        error("unable to open file: %s", path);
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+    {
+        if (!up || isJpegName(path))
+            addName(list, path);
+        return;
+    }
+
+#ifndef _WIN32
+    for (p = up; p; p = p->up)
+    {
+        if (p->dev == st.st_dev && p->ino == st.st_ino)
+            return;
+    }
+#endif
+    self.dev = st.st_dev;
+    self.ino = st.st_ino;
+    self.up = up;
+
+    if (!(dir = opendir(path)))
+    {
+        error("unable to open directory: %s", path);
+        return;
+    }
+
+    while ((entry = readdir(dir)))
+    {
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+            addName(&entries, entry->d_name);
+    }
+    closedir(dir);
+
+    qsort(entries.names, entries.count, sizeof(char *), compareName);
+
+    for (x = 0; x < entries.count; x++)
+    {
+        child = malloc(strlen(path) + strlen(entries.names[x]) + 2);
+        sprintf(child, "%s%s%s", path, path[strlen(path) - 1] == '/' ? "" : "/", entries.names[x]);
+        findFiles(list, child, &self);
+        free(child);
+    }
+
+    freeNames(&entries);
+}
+
+static void runHash(void *arg)
+{
+    hash_job *job = arg;
+
+    if (jpegHash(job->path, &job->hash, job->size))
+        job->hash = NULL;
+}
+
+/*
+    The index is the saved hashes followed by the file names, each ending
+    in a zero byte.
+*/
+static int readIndex(const char *filename, hash_index *idx, name_list *names)
+{
+    char *buf;
+    long int start, end;
+    unsigned long int bufSize, x, first;
+    FILE *file;
+
+    if (!(file = fopen(filename, "rb")))
+        return 1;
+
+    if (hashIndexLoad(idx, file))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    // The rest of the file goes in a buffer with a zero byte after it
+    start = ftell(file);
+    fseek(file, 0, SEEK_END);
+    end = ftell(file);
+    fseek(file, start, SEEK_SET);
+
+    buf = malloc(end - start + 1);
+    bufSize = fread(buf, 1, end - start, file);
+    buf[bufSize] = '\0';
+    fclose(file);
+
+    for (x = 0, first = 0; x < bufSize && names->count < idx->count; x++)
+    {
+        if (!buf[x])
+        {
+            addName(names, buf + first);
+            first = x + 1;
+        }
+    }
+    free(buf);
+
+    if (names->count != idx->count)
+    {
+        hashIndexFree(idx);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int writeIndex(const char *filename, const hash_index *idx, const name_list *names)
+{
+    FILE *file;
+    int x, ret;
+
+    if (!(file = openOutput((char *) filename)))
+        return 1;
+
+    ret = hashIndexSave(idx, file);
+    for (x = 0; x < names->count; x++)
+        fwrite(names->names[x], 1, strlen(names->names[x]) + 1, file);
+    ret = ret || ferror(file);
+
+    if (file != stdout)
+        ret = fclose(file) || ret;
+
+    return ret;
+}
+
+int main (int argc, char **argv)
+{
+    hash_index idx;
+    name_list names = { 0 };
+    name_list files = { 0 };
+    hash_job *jobs;
+    uint64_t *hash;
+    int *matches;
+    int size = 16, distance = 10, threads = 0, radius, bits, count, x, y, failed = 0;
+    char *indexFile = NULL, *outputFile = NULL, *queryFile = NULL;
+
+    const char *optstring = "d:hi:j:o:q:s:V";
+    static const struct option opts[] =
+    {
+        { "distance", required_argument, 0, 'd' },
+        { "help", no_argument, 0, 'h' },
+        { "index", required_argument, 0, 'i' },
+        { "threads", required_argument, 0, 'j' },
+        { "output", required_argument, 0, 'o' },
+        { "query", required_argument, 0, 'q' },
+        { "size", required_argument, 0, 's' },
+        { "version", no_argument, 0, 'V' },
+        { 0, 0, 0, 0 }
+    };
+    int opt, longind = 0;
+
+    char *progname = "jpeg-dupes";
+
+    while ((opt = getopt_long(argc, argv, optstring, opts, &longind)) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            distance = atoi(optarg);
+            break;
+        case 'h':
+            usage(progname);
+            return 0;
+        case 'i':
+            indexFile = optarg;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'o':
+            outputFile = optarg;
+            break;
+        case 'q':
+            queryFile = optarg;
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'V':
+            version();
+            return 0;
+        };
+    }
+
+    if ((!indexFile && argc == optind) || size < 1 || distance < 0)
+    {
+        usage(progname);
+        return 255;
+    }
+
+    if (threads < 1)
+        threads = cpuCount();
+    threads = MIN(threads, MAX_THREADS);
+
+    if (indexFile)
+    {
+        if (readIndex(indexFile, &idx, &names))
+        {
+            error("invalid index: %s", indexFile);
+            return 1;
+        }
+
+        // The hashes in the index fix the hash size
+        for (size = 1; size * size < idx.bits; size++);
+        if (size * size != idx.bits)
+        {
+            error("invalid index: %s", indexFile);
+            return 1;
+        }
+    }
+    else
+    {
+        hashIndexInit(&idx, size * size);
+    }
+    bits = size * size;
+
+    // Hash the new files on the worker threads, then add them in order
+    for (x = optind; x < argc; x++)
+        findFiles(&files, argv[x], NULL);
+
+    jobs = malloc(MAX(files.count, 1) * sizeof(hash_job));
+    for (x = 0; x < files.count; x++)
+    {
+        jobs[x].path = files.names[x];
+        jobs[x].size = size;
+        jobs[x].hash = NULL;
+    }
+    parallelRun(runHash, jobs, sizeof(hash_job), files.count, threads);
+
+    for (x = 0; x < files.count; x++)
+    {
+        if (!jobs[x].hash)
+        {
+            error("error hashing image: %s", files.names[x]);
+            failed = 1;
+            continue;
+        }
+
+        hashIndexAdd(&idx, jobs[x].hash);
+        addName(&names, files.names[x]);
+        free(jobs[x].hash);
+    }
+    free(jobs);
+    freeNames(&files);
+
+    if (idx.built != idx.count)
+        hashIndexBuild(&idx);
+
+    // The largest distance in bits that still prints as at most distance
+    radius = ((distance + 1) * bits - 1) / 100;
+
+    if (queryFile)
+    {
+        if (jpegHash(queryFile, &hash, size))
+        {
+            error("error hashing image: %s", queryFile);
+            return 1;
+        }
+
+        count = hashIndexQuery(&idx, hash, radius, &matches);
+        for (x = 0; x < count; x++)
+            printf("%u\t%s\n", hammingDist(idx.hashes + (size_t) matches[x] * idx.words, hash, bits) * 100 / bits, names.names[matches[x]]);
+
+        free(matches);
+        free(hash);
+    }
+    else if (!outputFile)
+    {
+        for (x = 0; x < idx.count; x++)
+        {
+            hash = idx.hashes + (size_t) x * idx.words;
+            count = hashIndexQuery(&idx, hash, radius, &matches);
+
+            // Each pair is printed once, from its first image
+            for (y = 0; y < count; y++)
+            {
+                if (matches[y] > x)
+                    printf("%u\t%s\t%s\n", hammingDist(idx.hashes + (size_t) matches[y] * idx.words, hash, bits) * 100 / bits, names.names[x], names.names[matches[y]]);
+            }
+
+            free(matches);
+        }
+    }
+
+    if (outputFile && writeIndex(outputFile, &idx, &names))
+    {
+        error("unable to write index: %s", outputFile);
+        failed = 1;
+    }
+
+    // Cleanup
+    hashIndexFree(&idx);
+    freeNames(&names);
+
+    return failed;
+}
@@ -7,23 +7,79 @@
 #include <getopt.h>
 #include "jmetrics.h"
 
+enum HASH_FORMAT
+{
+    HASH_BIN,
+    HASH_HEX,
+    HASH_RAW
+};
+
 void usage(char *progname)
 {
     printf("usage: %s [options] image.jpg\n\n", progname);
     printf("options:\n\n");
+    printf("  -f, --format [arg]           set output format [bin, hex, raw]\n");
     printf("  -h, --help                   output program help\n");
     printf("  -s, --size [arg]             set fast comparison image hash size\n");
     printf("  -V, --version                output program version\n");
 }
 
+enum HASH_FORMAT parseFormat(const char *s)
+{
+    if (!strcmp("bin", s))
+        return HASH_BIN;
+    else if (!strcmp("hex", s))
+        return HASH_HEX;
+    else if (!strcmp("raw", s))
+        return HASH_RAW;
+
+    error("invalid hash format '%s'", s);
+    exit(255);
+}
+
+/*
+    Print the hash bits in order: as 1s and 0s, as hex digits of four
+    bits each, first bit highest, or as the packed words in little
+    endian bytes.
+*/
+void printHash(const uint64_t *hash, int bits, enum HASH_FORMAT format)
+{
+    int x, b, digit;
+
+    switch (format)
+    {
+    case HASH_BIN:
+        for (x = 0; x < bits; x++)
+            putchar((hash[x / 64] >> (x % 64) & 1) ? '1' : '0');
+        putchar('\n');
+        break;
+    case HASH_HEX:
+        for (x = 0; x < bits; x += 4)
+        {
+            digit = 0;
+            for (b = x; b < x + 4; b++)
+                digit = digit << 1 | (int) (hash[b / 64] >> (b % 64) & 1);
+            putchar("0123456789abcdef"[digit]);
+        }
+        putchar('\n');
+        break;
+    case HASH_RAW:
+        for (x = 0; x < HASH_WORDS(bits) * 8; x++)
+            putchar((int) (hash[x / 8] >> (x % 8 * 8) & 0xff));
+        break;
+    }
+}
+
 int main (int argc, char **argv)
 {
-    unsigned char *hash;
-    int size = 16, x;
+    uint64_t *hash;
+    int size = 16;
+    enum HASH_FORMAT format = HASH_BIN;
 
-    const char *optstring = "hs:V";
+    const char *optstring = "f:hs:V";
     static const struct option opts[] =
     {
+        { "format", required_argument, 0, 'f' },
         { "help", no_argument, 0, 'h' },
         { "size", required_argument, 0, 's' },
         { "version", no_argument, 0, 'V' },
@@ -37,6 +93,9 @@ int main (int argc, char **argv)
     {
         switch (opt)
         {
+        case 'f':
+            format = parseFormat(optarg);
+            break;
         case 'h':
             usage(progname);
             return 0;
@@ -62,12 +121,12 @@ int main (int argc, char **argv)
         return 1;
     }
 
-    // Print out the hash a string of 1s and 0s
-    for (x = 0; x < size * size; x++)
-    {
-        printf("%c", hash[x] ? '1' : '0');
-    }
-    printf("\n");
+#ifdef _WIN32
+    if (format == HASH_RAW)
+        setmode(fileno(stdout), O_BINARY);
+#endif
+
+    printHash(hash, size * size, format);
 
     // Cleanup
     free(hash);
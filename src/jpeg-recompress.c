@@ -10,6 +10,16 @@
 
 const char *COMMENT = "Compressed by jpeg-recompress";
 
+// Proxy search: smallest proxy side, full size steps and their range
+#define PROXY_MIN_SIZE 256
+#define PROXY_CONFIRM 2
+#define PROXY_MARGIN 2
+
+// Tile sampling: tiles are whole MCUs of any subsampling, and an image
+// needs enough of them to be worth sampling
+#define SAMPLE_TILE 64
+#define SAMPLE_MIN_TILES 64
+
 void usage(char *progname)
 {
     printf("usage: %s [options] input.jpg output.jpg\n\n", progname);
@@ -17,8 +27,9 @@ void usage(char *progname)
     printf("  -a, --accurate               favor accuracy over speed\n");
     printf("  -c, --no-copy                disable copying files that will not be compressed\n");
     printf("  -d, --defish [arg]           set defish strength [0.0]\n");
-    printf("  -f, --force                  force process\n");
+    printf("  -f, --force                  recompress files that would be copied, even when larger\n");
     printf("  -h, --help                   output program help\n");
+    printf("  -j, --threads [arg]          evaluate search candidates on N threads, 0 - all CPUs [1]\n");
     printf("  -l, --loops [arg]            set the number of runs to attempt [6]\n");
     printf("  -m, --method [arg]           set comparison method to one of:\n");
     printf("                               'mpe', 'psnr', 'mse', 'msef', 'cor', 'ssim', 'ms-ssim', 'vifp1',\n");
@@ -27,15 +38,291 @@ void usage(char *progname)
     printf("  -p, --no-progressive         disable progressive encoding\n");
     printf("  -q, --quality [arg]          set a quality preset: low, medium, subhigh, high, veryhigh [medium]\n");
     printf("  -r, --ppm                    parse input as PPM\n");
+    printf("  -R, --requantize             requantize JPEG input in the DCT domain instead of re-encoding pixels\n");
     printf("  -s, --strip                  strip metadata\n");
     printf("  -t, --target [arg]           set target quality [0.75]\n");
     printf("  -x, --max [arg]              maximum JPEG quality [98]\n");
     printf("  -z, --zoom [arg]             set defish zoom [1.0]\n");
+    printf("  -P, --proxy [arg]            search on an image downscaled N times, confirm at full size [0]\n");
     printf("  -Q, --quiet                  only print out errors\n");
-    printf("  -S, --subsample [arg]        set subsampling method to one of 'default', 'disable' [default]\n");
+    printf("  -S, --subsample [arg]        set subsampling method to one of 'default', 'disable', '422' [default]\n");
     printf("  -T, --input-filetype [arg]   set input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
     printf("  -V, --version                output program version\n");
     printf("  -Y, --ycbcr [arg]            YCbCr jpeg colorspace: 0 - source, >0 - YCrCb, <0 - RGB\n");
+    printf("      --no-seed                always search the full quality range\n");
+    printf("      --search [arg]           quality search strategy [bisect, secant, hybrid]\n");
+    printf("      --sample [arg]           search on a sample of N%% of the image tiles, 0 - whole image [0]\n");
+}
+
+// One candidate quality of the search, evaluated on a worker thread
+typedef struct
+{
+    const jpeg_planes *planes;
+    jpeg_dct_luma *dct;
+    const metric_context *reference;
+    jpeg_transcoder *transcoder;
+    int width, height, optimize, method;
+    int lumaOnly;
+    int scored;
+    int quality;
+    // Scored quality the score is updated from, 0 for none
+    int from;
+    unsigned long size;
+    float umetric;
+    int failed;
+} trial_t;
+
+// Images a search runs on and the results evaluated so far, by quality
+typedef struct
+{
+    trial_t base;
+    char known[101];
+    float metric[101];
+    unsigned long size[101];
+} trial_cache;
+
+// Node of the bisection decision tree: search state and depth
+typedef struct
+{
+    quality_search qs;
+    int depth;
+} trial_node;
+
+static void runTrial(void *arg)
+{
+    trial_t *trial = arg;
+    unsigned char *jpeg = NULL, *gray = NULL;
+    int width, height, jpegcs;
+    float metric;
+
+    if (trial->dct && trial->scored)
+    {
+        // Error straight from the coefficients, no luma at all
+        trial->size = dctLumaScore(trial->dct, trial->method, trial->quality, trial->from, trial->optimize, &metric);
+        trial->umetric = MetricRescale(trial->method, metric);
+        trial->failed = 0;
+        return;
+    }
+
+    if (trial->dct)
+    {
+        // Luma straight from the quantized blocks, no bitstream
+        trial->size = dctLumaTrial(trial->dct, trial->quality, trial->optimize, &gray);
+        width = trial->dct->width;
+        height = trial->dct->height;
+        trial->failed = !trial->size;
+    }
+    else
+    {
+        if (trial->transcoder)
+            trial->size = transcodeJpeg(trial->transcoder, &jpeg, trial->quality, 0, trial->optimize, trial->lumaOnly);
+        else
+            trial->size = encodeJpegPlanes(&jpeg, trial->planes, trial->quality, 0, trial->optimize, trial->lumaOnly);
+        trial->failed = !decodeJpeg(jpeg, trial->size, &gray, &width, &height, &jpegcs, JCS_GRAYSCALE);
+    }
+    if (!trial->failed)
+    {
+        metric = MetricCalcPrepared(trial->reference, gray);
+        trial->umetric = MetricRescale(trial->method, metric);
+        free(gray);
+    }
+    free(jpeg);
+}
+
+static int queueTrial(trial_t *trials, int count, int quality, const char *known)
+{
+    int i;
+
+    if (known[quality])
+        return count;
+    for (i = 0; i < count; i++)
+        if (trials[i].quality == quality)
+            return count;
+
+    trials[count].quality = quality;
+    return count + 1;
+}
+
+/*
+    Collect up to maxTrials qualities that have not been evaluated yet.
+    Bisection walks its decision tree breadth-first and follows both
+    outcomes of an unknown node, so after evaluating the collected trials
+    the serial search can take its next steps without waiting, and picks
+    exactly the same qualities it would alone. The model searches cannot
+    predict past an unknown step, so they spend spare threads on the
+    neighbours of the predicted quality instead.
+*/
+static int collectTrials(trial_t *trials, int maxTrials, const quality_search *qs, int depth, const char *known, const float *knownMetric)
+{
+    trial_node queue[MAX_THREADS + 2], node;
+    int head = 0, tail = 0, live = 0, count = 0;
+    int quality, offset;
+
+    if (qs->strategy != SEARCH_BISECT)
+    {
+        quality = searchNext(qs);
+        count = queueTrial(trials, count, quality, known);
+        for (offset = 1; count < maxTrials && offset <= qs->max - qs->min; offset++)
+        {
+            if (quality + offset <= qs->max)
+                count = queueTrial(trials, count, quality + offset, known);
+            if (count < maxTrials && quality - offset > qs->min)
+                count = queueTrial(trials, count, quality - offset, known);
+        }
+        return count;
+    }
+
+    queue[tail].qs = *qs;
+    queue[tail].depth = 0;
+    tail = (tail + 1) % (MAX_THREADS + 2);
+    live++;
+
+    while (live > 0 && count < maxTrials)
+    {
+        node = queue[head];
+        head = (head + 1) % (MAX_THREADS + 2);
+        live--;
+
+        if (searchDone(&node.qs) || node.depth >= depth)
+            continue;
+
+        quality = searchNext(&node.qs);
+        count = queueTrial(trials, count, quality, known);
+
+        // Follow the branch that will be taken, or both when unknown
+        if (known[quality] ? knownMetric[quality] < qs->target : 1)
+        {
+            queue[tail] = node;
+            searchUpdate(&queue[tail].qs, quality, qs->target - 1.0f);
+            queue[tail].depth++;
+            tail = (tail + 1) % (MAX_THREADS + 2);
+            live++;
+        }
+        if (known[quality] ? knownMetric[quality] >= qs->target : 1)
+        {
+            queue[tail] = node;
+            searchUpdate(&queue[tail].qs, quality, qs->target + 1.0f);
+            queue[tail].depth++;
+            tail = (tail + 1) % (MAX_THREADS + 2);
+            live++;
+        }
+    }
+
+    return count;
+}
+
+// Nearest quality evaluated so far, 0 if none
+static int nearestKnown(const char *known, int quality)
+{
+    int offset;
+
+    for (offset = 1; offset < 100; offset++)
+    {
+        if (quality - offset > 0 && known[quality - offset])
+            return quality - offset;
+        if (quality + offset <= 100 && known[quality + offset])
+            return quality + offset;
+    }
+
+    return 0;
+}
+
+static void storeTrial(trial_cache *cache, const trial_t *trial)
+{
+    cache->known[trial->quality] = 1;
+    cache->metric[trial->quality] = trial->umetric;
+    cache->size[trial->quality] = trial->size;
+}
+
+/*
+    Run the search on the images of cache for attempts - 1 steps. Trials
+    below the target must stay smaller than maxSize, if given. Returns 0
+    when done, 1 if an encode failed and 2 if the output would grow.
+*/
+static int searchQuality(quality_search *qs, trial_cache *cache, int attempts, int lowest, int highest,
+                         int threads, unsigned long maxSize, const char *label, int quiet)
+{
+    trial_t trials[MAX_THREADS];
+    int attempt, quality, trialQuality, trialCount, i;
+
+    qs->steps = attempts - 1;
+    for (attempt = attempts - 1; attempt > 0; --attempt)
+    {
+        if (searchDone(qs))
+        {
+            if (!searchWiden(qs, lowest, highest, &attempt))
+                break;
+            info(quiet, "Widening search range to %i - %i\n", qs->min, qs->max);
+        }
+
+        quality = searchNext(qs);
+
+        if (!cache->known[quality])
+        {
+            trialCount = collectTrials(trials, threads, qs, attempt, cache->known, cache->metric);
+            for (i = 0; i < trialCount; i++)
+            {
+                trialQuality = trials[i].quality;
+                trials[i] = cache->base;
+                trials[i].quality = trialQuality;
+                trials[i].from = nearestKnown(cache->known, trialQuality);
+            }
+
+            // Recompress to new quality levels, without optimizations (for speed)
+            parallelRun(runTrial, trials, sizeof(trial_t), trialCount, threads);
+
+            for (i = 0; i < trialCount; i++)
+            {
+                if (trials[i].failed)
+                {
+                    error("unable to decode file that was just encoded!");
+                    return 1;
+                }
+                storeTrial(cache, &trials[i]);
+            }
+        }
+
+        info(quiet, "%s%s", label, MetricName(cache->base.method));
+        info(quiet, " at q=%i (%i - %i): UM %f\n", quality, qs->min, qs->max, cache->metric[quality]);
+
+        if (maxSize && cache->metric[quality] < qs->target && cache->size[quality] >= maxSize)
+            return 2;
+
+        searchUpdate(qs, quality, cache->metric[quality]);
+    }
+
+    return 0;
+}
+
+/*
+    Copy the input file to the output unchanged, or fail with the given
+    exit code when copying is disabled. Returns the program exit code.
+*/
+static int copyInput(char *outputPath, unsigned char *buf, long bufSize, int copyFiles, int quiet, const char *message, const char *errorMessage, int errorCode)
+{
+    FILE *file;
+
+    if (!copyFiles)
+    {
+        error("%s", errorMessage);
+        free(buf);
+        return errorCode;
+    }
+
+    info(quiet, message);
+    file = openOutput(outputPath);
+    if (file == NULL)
+    {
+        error("could not open output file: %s", outputPath);
+        return 1;
+    }
+
+    fwrite(buf, bufSize, 1, file);
+    fclose(file);
+
+    free(buf);
+
+    return 0;
 }
 
 int main (int argc, char **argv)
@@ -45,6 +332,9 @@ int main (int argc, char **argv)
     // Number of binary search steps
     int attempts = 8;
 
+    // Worker threads for speculative search trials
+    int threads = 1;
+
     float target = 0.0f;
     int preset = MEDIUM;
 
@@ -76,6 +366,31 @@ int main (int argc, char **argv)
     // Chroma subsampling method
     int subsample = SUBSAMPLE_DEFAULT;
 
+    // Requantize JPEG input instead of re-encoding its pixels?
+    int requant = 0;
+    jpeg_transcoder transcoder;
+    jpeg_header header;
+
+    // Seed the search range from the source quality?
+    int seed = 1;
+    int sourceQuality = 0;
+
+    // How to pick the next quality to try
+    int strategy = SEARCH_BISECT;
+    quality_search qs, proxyQs;
+
+    // Downscale factor of the proxy image searched first, 0 - none
+    int proxyFactor = 0;
+    unsigned char *proxyImage, *proxyGray;
+    jpeg_planes proxyPlanes;
+    float proxyOffset;
+
+    // Percentage of tiles scored during the search, 0 - whole image
+    int samplePercent = 0;
+    unsigned char *sampleImage, *sampleGray = NULL;
+    jpeg_planes samplePlanes;
+    unsigned long samplePixels, maxSize;
+
     // Quiet mode (less output)
     int quiet = 0;
 
@@ -84,14 +399,27 @@ int main (int argc, char **argv)
     long bufSize = 0, originalSize = 0, originalGraySize = 0;
     long compressedGraySize = 0;
     unsigned long compressedSize = 0, saved = 0;
-    int width, height, min, max, attempt, jpegcs, jpegcst;
+    int width, height, min, max, jpegcs, jpegcst;
     int quality, progressive, optimize, percent, app0_len;
     unsigned int metaSize = 0;
     float metric, umetric;
     char *inputPath, *outputPath;
     FILE *file;
 
-    const char *optstring = "acd:fhl:m:n:pq:rst:x:z:QS:T:VY:";
+    // Color converted and downsampled image, prepared once
+    jpeg_planes planes;
+
+    // Luma DCT blocks that trials quantize without entropy coding
+    jpeg_dct_luma dct, proxyDct;
+
+    // Search results evaluated so far, at full size and on the proxy
+    trial_cache full, proxy;
+
+    // Metric of the original luma, and of the sample and proxy ones
+    metric_context reference, sampleReference, proxyReference;
+    trial_t calibration[2];
+
+    const char *optstring = "acd:fhj:l:m:n:pq:rRst:x:z:P:QS:T:VY:";
     static const struct option opts[] =
     {
         { "accurate", no_argument, 0, 'a' },
@@ -105,12 +433,18 @@ int main (int argc, char **argv)
         { "min", required_argument, 0, 'n' },
         { "no-copy", no_argument, 0, 'c' },
         { "no-progressive", no_argument, 0, 'p' },
+        { "no-seed", no_argument, 0, OPT_NOSEED },
         { "ppm", no_argument, 0, 'r' },
+        { "proxy", required_argument, 0, 'P' },
+        { "sample", required_argument, 0, OPT_SAMPLE },
+        { "search", required_argument, 0, OPT_SEARCH },
         { "quality", required_argument, 0, 'q' },
         { "quiet", no_argument, 0, 'Q' },
+        { "requantize", no_argument, 0, 'R' },
         { "target", required_argument, 0, 't' },
         { "strip", no_argument, 0, 's' },
         { "subsample", required_argument, 0, 'S' },
+        { "threads", required_argument, 0, 'j' },
         { "version", no_argument, 0, 'V' },
         { "ycbcr", required_argument, 0, 'Y' },
         { "zoom", required_argument, 0, 'z' },
@@ -139,6 +473,9 @@ int main (int argc, char **argv)
         case 'h':
             usage(progname);
             return 0;
+        case 'j':
+            threads = atoi(optarg);
+            break;
         case 'l':
             attempts = atoi(optarg);
             break;
@@ -157,6 +494,9 @@ int main (int argc, char **argv)
         case 'r':
             inputFiletype = FILETYPE_PPM;
             break;
+        case 'R':
+            requant = 1;
+            break;
         case 's':
             strip = 1;
             break;
@@ -180,6 +520,9 @@ int main (int argc, char **argv)
             }
             inputFiletype = parseInputFiletype(optarg);
             break;
+        case 'P':
+            proxyFactor = atoi(optarg);
+            break;
         case 'Q':
             quiet = 1;
             break;
@@ -189,6 +532,15 @@ int main (int argc, char **argv)
         case 'Y':
             ycbcr = atoi(optarg);
             break;
+        case OPT_NOSEED:
+            seed = 0;
+            break;
+        case OPT_SEARCH:
+            strategy = parseSearch(optarg);
+            break;
+        case OPT_SAMPLE:
+            samplePercent = clamp(0, atoi(optarg), 100);
+            break;
         };
     }
 
@@ -214,6 +566,15 @@ int main (int argc, char **argv)
         target = setTargetFromPreset(preset);
     }
 
+    if (threads < 1)
+        threads = cpuCount();
+    threads = MIN(threads, MAX_THREADS);
+    attempts = MAX(attempts, 1);
+
+    // Combined methods split the CPUs left over per search candidate
+    // between their component metrics
+    MetricSetThreads(MAX(1, cpuCount() / threads));
+
     /* Read the input into a buffer. */
     bufSize = readFile(inputPath, (void **) &buf);
 
@@ -221,11 +582,52 @@ int main (int argc, char **argv)
     if (inputFiletype == FILETYPE_AUTO)
         inputFiletype = detectFiletypeFromBuffer(buf, bufSize);
 
+    if (jpegMin > jpegMax)
+    {
+        error("maximum JPEG quality must not be smaller than minimum JPEG quality!");
+        return 1;
+    }
+
+    // libjpeg clamps qualities to 1 - 100 anyway
+    jpegMin = clamp(1, jpegMin, 100);
+    jpegMax = clamp(1, jpegMax, 100);
+
+    if (inputFiletype == FILETYPE_JPEG)
+    {
+        // Decide from the headers alone whether there is anything to do
+        if (scanJpegHeader(buf, bufSize, &header, COMMENT))
+        {
+            error("invalid input file: %s", inputPath);
+            return 1;
+        }
+
+        if (header.processed && !force)
+            return copyInput(outputPath, buf, bufSize, copyFiles, quiet,
+                             "File already processed by jpeg-recompress!\n",
+                             "file already processed by jpeg-recompress!", 2);
+
+        sourceQuality = header.quality;
+        if (sourceQuality)
+            info(quiet, "Source quality is about %i\n", sourceQuality);
+
+        // Any trial would be finer than the source, so larger too
+        if (sourceQuality && sourceQuality < jpegMin && !defishStrength && !force)
+            return copyInput(outputPath, buf, bufSize, copyFiles, quiet,
+                             "Source quality is below the minimum!\n",
+                             "source quality is below the minimum!", 1);
+
+        // Read metadata (EXIF / IPTC / XMP tags)
+        getMetadata(buf, bufSize, &metaBuf, &metaSize, NULL);
+    }
+
     /*
      * Read original image and decode. We need the raw buffer contents and its
      * size to obtain meta data and the original file size later.
      */
-    originalSize = decodeFileFromBuffer(buf, bufSize, &original, inputFiletype, &width, &height, &jpegcs, JCS_RGB);
+    if (defishStrength)
+        originalSize = decodeFileFromBuffer(buf, bufSize, &original, inputFiletype, &width, &height, &jpegcs, JCS_RGB);
+    else
+        originalSize = decodeFileFromBufferGray(buf, bufSize, &original, &originalGray, inputFiletype, &width, &height, &jpegcs);
     if (!originalSize)
     {
         error("invalid input file: %s", inputPath);
@@ -239,41 +641,11 @@ int main (int argc, char **argv)
         defish(original, tmpImage, width, height, 3, defishStrength, defishZoom);
         free(original);
         original = tmpImage;
-    }
 
-    // Convert RGB input into Y
-    originalGraySize = grayscale(original, &originalGray, width, height);
-
-    if (inputFiletype == FILETYPE_JPEG)
-    {
-        // Read metadata (EXIF / IPTC / XMP tags)
-        if (getMetadata(buf, bufSize, &metaBuf, &metaSize, COMMENT) && !force)
-        {
-            if (copyFiles)
-            {
-                info(quiet, "File already processed by jpeg-recompress!\n");
-                file = openOutput(outputPath);
-                if (file == NULL)
-                {
-                    error("could not open output file: %s", outputPath);
-                    return 1;
-                }
-
-                fwrite(buf, bufSize, 1, file);
-                fclose(file);
-
-                free(buf);
-
-                return 0;
-            }
-            else
-            {
-                error("file already processed by jpeg-recompress!");
-                free(buf);
-                return 2;
-            }
-        }
+        // Convert RGB input into Y
+        grayscale(original, &originalGray, width, height);
     }
+    originalGraySize = originalGray ? (unsigned long) width * height : 0;
 
     if (strip)
         metaSize = 0;
@@ -288,96 +660,227 @@ int main (int argc, char **argv)
     if (ycbcr > 0)
         jpegcs = JCS_YCbCr;
 
-    if (jpegMin > jpegMax)
+    if (requant)
     {
-        error("maximum JPEG quality must not be smaller than minimum JPEG quality!");
-        return 1;
+        // Requantization keeps the source pixels, sampling and color space
+        if (inputFiletype != FILETYPE_JPEG || defishStrength || ycbcr)
+            requant = 0;
+        else if (transcoderInit(&transcoder, buf, bufSize))
+            requant = 0;
+        else if ((subsample == SUBSAMPLE_444 && transcoder.cinfo.max_h_samp_factor * transcoder.cinfo.max_v_samp_factor > 1) ||
+                 (subsample == SUBSAMPLE_422 && (transcoder.cinfo.max_h_samp_factor != 2 || transcoder.cinfo.max_v_samp_factor != 1)))
+        {
+            transcoderFree(&transcoder);
+            requant = 0;
+        }
+
+        if (!requant)
+            info(quiet, "Cannot requantize this input, re-encoding pixels\n");
     }
 
-    // Do a binary search to find the optimal encoding quality for the
-    // given target SSIM value.
+    // Search for the optimal encoding quality for the given target
+    // value. With several threads the next steps of the search are
+    // evaluated speculatively, but the search still takes them one by
+    // one, so it picks the same quality.
     min = jpegMin;
     max = jpegMax;
-    for (attempt = attempts - 1; attempt >= 0; --attempt)
+
+    // Start near the quality the source suggests. An edge of the seeded
+    // range that no trial confirms is reopened once the search converges.
+    if (seed && sourceQuality)
+    {
+        seedQualityRange(method, target, sourceQuality, 0, &min, &max);
+        info(quiet, "Seeded search range is %i - %i\n", min, max);
+    }
+    searchInit(&qs, strategy, target, min, max);
+
+    // Convert and downsample once instead of on every encode
+    if (!requant && planesInit(&planes, original, width, height, jpegcs, subsample))
+    {
+        error("unsupported output color space!");
+        return 1;
+    }
+
+    memset(&full, 0, sizeof(full));
+    full.base.planes = &planes;
+    MetricPrepare(&reference, method, originalGray, width, height, 1);
+    full.base.reference = &reference;
+    full.base.transcoder = requant ? &transcoder : NULL;
+    full.base.width = width;
+    full.base.height = height;
+    full.base.optimize = accurate;
+    full.base.method = method;
+    // With --force the output is written even when it is larger
+    maxSize = force ? 0 : bufSize;
+
+    // Trials are only scored on luma, so they only code the Y plane and
+    // the final encode adds color. Their size is then a lower bound, which
+    // still rules out qualities that cannot get smaller than the input.
+    full.base.lumaOnly = (jpegcs == JCS_YCbCr || jpegcs == JCS_GRAYSCALE);
+
+    if (samplePercent && (width / SAMPLE_TILE) * (height / SAMPLE_TILE) < SAMPLE_MIN_TILES)
     {
-        quality = (max + min + 1) / 2;
+        info(quiet, "Image is too small to sample tiles\n");
+        samplePercent = 0;
+    }
 
-        /* Terminate early once bisection interval is a singleton. */
-        if (min == max)
-            attempt = 0;
+    // Search on a sample of tiles and encode the whole image only at the
+    // end. Tiles hold whole MCUs, so they encode exactly as they do in
+    // place. The size check scales the sample size up to the image.
+    if (samplePercent)
+    {
+        samplePixels = sampleTiles(original, originalGray, width, height, SAMPLE_TILE, samplePercent,
+                                   &sampleImage, &full.base.width, &full.base.height);
+        grayscale(sampleImage, &sampleGray, full.base.width, full.base.height);
+        planesInit(&samplePlanes, sampleImage, full.base.width, full.base.height, jpegcs, subsample);
+        free(sampleImage);
+        full.base.planes = &samplePlanes;
+        MetricPrepare(&sampleReference, method, sampleGray, full.base.width, full.base.height, 1);
+        full.base.reference = &sampleReference;
+        full.base.transcoder = NULL;
+        if (maxSize)
+            maxSize = (unsigned long) ((double) bufSize * samplePixels / ((double) width * height));
+        info(quiet, "Sampled tiles are %ix%i\n", full.base.width, full.base.height);
+    }
 
-        progressive = attempt ? 0 : !noProgressive;
-        optimize = accurate ? 1 : (attempt ? 0 : 1);
+    // Luma-only trials skip the bitstream: quantized blocks give the size
+    // from their Huffman symbols and the luma through the inverse DCT
+    if (full.base.lumaOnly && !full.base.transcoder && !dctLumaInit(&dct, full.base.planes))
+    {
+        full.base.dct = &dct;
+        dctLumaReference(&dct, full.base.planes, full.base.reference->reference);
+    }
 
-        // Recompress to a new quality level, without optimizations (for speed)
-        compressedSize = encodeJpeg(&compressed, original, width, height, JCS_RGB, quality, jpegcs, progressive, optimize, subsample);
+    // Error based methods score trials from the coefficients, and only
+    // the final encode is measured on its decoded luma
+    full.base.scored = full.base.dct && !accurate && dctLumaScored(method);
+
+    if (proxyFactor > 1 && MIN(width, height) / proxyFactor < PROXY_MIN_SIZE)
+    {
+        info(quiet, "Image is too small for a proxy search\n");
+        proxyFactor = 0;
+    }
+
+    // Take the early steps on a downscaled proxy and only confirm the
+    // result at full size. Proxy UM is shifted by its difference to the
+    // full size UM at the first quality, so that any method maps over.
+    if (proxyFactor > 1)
+    {
+        proxy = full;
+        proxy.base.transcoder = NULL;
+        downscale(original, &proxyImage, width, height, 3, proxyFactor, &proxy.base.width, &proxy.base.height);
+        grayscale(proxyImage, &proxyGray, proxy.base.width, proxy.base.height);
+        planesInit(&proxyPlanes, proxyImage, proxy.base.width, proxy.base.height, jpegcs, subsample);
+        free(proxyImage);
+        proxy.base.planes = &proxyPlanes;
+        MetricPrepare(&proxyReference, method, proxyGray, proxy.base.width, proxy.base.height, 1);
+        proxy.base.reference = &proxyReference;
+        proxy.base.dct = NULL;
+        if (full.base.dct && !dctLumaInit(&proxyDct, &proxyPlanes))
+        {
+            proxy.base.dct = &proxyDct;
+            dctLumaReference(&proxyDct, &proxyPlanes, proxyGray);
+        }
+        proxy.base.scored = proxy.base.dct && full.base.scored;
 
-        // Load compressed luma for quality comparison
-        compressedGraySize = decodeJpeg(compressed, compressedSize, &compressedGray, &width, &height, &jpegcst, JCS_GRAYSCALE);
+        calibration[0] = full.base;
+        calibration[1] = proxy.base;
+        calibration[0].quality = calibration[1].quality = searchNext(&qs);
+        parallelRun(runTrial, calibration, sizeof(trial_t), 2, threads);
 
-        if (!compressedGraySize)
+        if (calibration[0].failed || calibration[1].failed)
         {
             error("unable to decode file that was just encoded!");
             return 1;
         }
+        storeTrial(&full, &calibration[0]);
+        storeTrial(&proxy, &calibration[1]);
+        proxyOffset = calibration[0].umetric - calibration[1].umetric;
+        info(quiet, "Proxy is %ix%i, UM offset %f\n", proxy.base.width, proxy.base.height, proxyOffset);
+
+        proxyQs = qs;
+        proxyQs.target = target - proxyOffset;
+        // Proxy steps are cheap, so run as many as the range needs and
+        // leave a step to notice an edge that must be widened
+        if (searchQuality(&proxyQs, &proxy, searchSteps(&proxyQs) + 2, jpegMin, jpegMax, threads, 0, "Proxy ", quiet))
+            return 1;
 
-        if (!attempt)
-            info(quiet, "Final optimized ");
+        free(proxyGray);
+        planesFree(&proxyPlanes);
+        if (proxy.base.dct)
+            dctLumaFree(&proxyDct);
 
-        // Measure quality difference
-        metric = MetricCalc(method, originalGray, compressedGray, width, height, 1);
-        umetric = MetricRescale(method, metric);
-        info(quiet, MetricName(method));
+        quality = searchNext(&proxyQs);
+        min = MAX(quality - PROXY_MARGIN, jpegMin);
+        max = MIN(quality + PROXY_MARGIN, jpegMax);
+        searchInit(&qs, strategy, target, min, max);
+        attempts = PROXY_CONFIRM + 2;
+    }
 
-        if (attempt)
-            info(quiet, " at q=%i (%i - %i): UM %f\n", quality, min, max, umetric);
-        else
-            info(quiet, " at q=%i: UM %f\n", quality, umetric);
+    // Everything is encoded from planes or coefficients from here on
+    free(original);
 
-        if (umetric < target)
-        {
-            if (compressedSize >= bufSize)
-            {
-                free(compressed);
-                free(compressedGray);
+    switch (searchQuality(&qs, &full, attempts, jpegMin, jpegMax, threads, maxSize, "", quiet))
+    {
+    case 1:
+        return 1;
+    case 2:
+        return copyInput(outputPath, buf, bufSize, copyFiles, quiet,
+                         "Output file would be larger than input!\n",
+                         "output file would be larger than input!", 1);
+    }
 
-                if (copyFiles)
-                {
-                    info(quiet, "Output file would be larger than input!\n");
-                    file = openOutput(outputPath);
-                    if (file == NULL)
-                    {
-                        error("could not open output file: %s", outputPath);
-                        return 1;
-                    }
+    if (full.base.dct)
+        dctLumaFree(&dct);
 
-                    fwrite(buf, bufSize, 1, file);
-                    fclose(file);
+    if (samplePercent)
+    {
+        free(sampleGray);
+        planesFree(&samplePlanes);
+    }
 
-                    free(buf);
+    // Final attempt at the chosen quality, with all optimizations
+    quality = searchNext(&qs);
+    progressive = !noProgressive;
+    optimize = 1;
 
-                    return 0;
-                }
-                else
-                {
-                    error("output file would be larger than input!");
-                    free(buf);
-                    return 1;
-                }
-            }
-            min = MIN(quality, max);
-        }
-        else
-        {
-            max = MAX(quality, min);
-        }
+    if (requant)
+    {
+        compressedSize = transcodeJpeg(&transcoder, &compressed, quality, progressive, optimize, 0);
+        transcoderFree(&transcoder);
+    }
+    else
+    {
+        compressedSize = encodeJpegPlanes(&compressed, &planes, quality, progressive, optimize, 0);
+        planesFree(&planes);
+    }
 
-        // If we aren't done yet, then free the image data
-        if (attempt)
-        {
-            free(compressed);
-            free(compressedGray);
-        }
+    // Load compressed luma for quality comparison
+    compressedGraySize = decodeJpeg(compressed, compressedSize, &compressedGray, &width, &height, &jpegcst, JCS_GRAYSCALE);
+
+    if (!compressedGraySize)
+    {
+        error("unable to decode file that was just encoded!");
+        return 1;
+    }
+
+    // Measure quality difference
+    metric = MetricCalcPrepared(&reference, compressedGray);
+    umetric = MetricRescale(method, metric);
+    free(compressedGray);
+
+    info(quiet, "Final optimized ");
+    info(quiet, MetricName(method));
+    info(quiet, " at q=%i: UM %f\n", quality, umetric);
+
+    // Luma-only trials cannot see the chroma size, so the color output
+    // may still turn out larger than the input
+    if (compressedSize >= bufSize && !force)
+    {
+        free(compressed);
+        return copyInput(outputPath, buf, bufSize, copyFiles, quiet,
+                         "Output file would be larger than input!\n",
+                         "output file would be larger than input!", 1);
     }
 
     free(buf);
@@ -387,12 +890,6 @@ int main (int argc, char **argv)
     saved = (bufSize > (compressedSize + metaSize)) ? (bufSize - compressedSize - metaSize) : 0;
     info(quiet, "New size is %i%% of original (saved %lu kb)\n", percent, saved / 1024);
 
-    if (compressedSize >= bufSize && !force)
-    {
-        error("output file is larger than input, aborting!");
-        return 1;
-    }
-
     // Open output file for writing
     file = openOutput(outputPath);
     if (file == NULL)
@@ -441,7 +938,6 @@ int main (int argc, char **argv)
         free(metaBuf);
 
     free(compressed);
-    free(original);
     free(originalGray);
 
     return 0;
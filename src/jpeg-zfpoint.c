@@ -28,10 +28,11 @@ void usage(char *progname)
     printf("  -z, --zoom [arg]             set defish zoom [1.0]\n");
     printf("  -A, --radius [arg]           sharpen radius [2]\n");
     printf("  -Q, --quiet                  only print out errors\n");
-    printf("  -S, --subsample [arg]        set subsampling method to one of 'default', 'disable' [default]\n");
+    printf("  -S, --subsample [arg]        set subsampling method to one of 'default', 'disable', '422' [default]\n");
     printf("  -T, --input-filetype [arg]   set input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
     printf("  -V, --version                output program version\n");
     printf("  -Y, --ycbcr [arg]            YCbCr jpeg colorspace: 0 - source, >0 - YCrCb, <0 - RGB\n");
+    printf("      --search [arg]           quality search strategy [bisect, secant, hybrid]\n");
 }
 
 int main (int argc, char **argv)
@@ -71,6 +72,9 @@ int main (int argc, char **argv)
     // Quiet mode (less output)
     int quiet = 0;
 
+    // How to pick the next quality to try
+    int strategy = SEARCH_BISECT;
+
     unsigned char *buf, *original, *originalGray = NULL, *tmpImage;
     unsigned char *compressed = NULL, *compressedGray, *metaBuf;
     long bufSize = 0, originalSize = 0, originalGraySize = 0;
@@ -80,6 +84,8 @@ int main (int argc, char **argv)
     int jpegcs, jpegcst, quality, progressive, optimize;
     unsigned int metaSize = 0;
     float metric, maxmetric, qmetric, cmpMin, cmpMax, cmpQ;
+    int modelX[3], width0, vertex, prevKnown = 0;
+    float modelY[3];
     char *inputPath, *outputPath;
     FILE *file;
 
@@ -97,6 +103,7 @@ int main (int argc, char **argv)
         { "no-copy", no_argument, 0, 'c' },
         { "no-progressive", no_argument, 0, 'p' },
         { "ppm", no_argument, 0, 'r' },
+        { "search", required_argument, 0, OPT_SEARCH },
         { "quiet", no_argument, 0, 'Q' },
         { "radius", required_argument, 0, 'A' },
         { "strip", no_argument, 0, 's' },
@@ -173,6 +180,9 @@ int main (int argc, char **argv)
         case 'Y':
             ycbcr = atoi(optarg);
             break;
+        case OPT_SEARCH:
+            strategy = parseSearch(optarg);
+            break;
         };
     }
 
@@ -196,7 +206,10 @@ int main (int argc, char **argv)
      * Read original image and decode. We need the raw buffer contents and its
      * size to obtain meta data and the original file size later.
      */
-    originalSize = decodeFileFromBuffer(buf, bufSize, &original, inputFiletype, &width, &height, &jpegcs, JCS_RGB);
+    if (defishStrength)
+        originalSize = decodeFileFromBuffer(buf, bufSize, &original, inputFiletype, &width, &height, &jpegcs, JCS_RGB);
+    else
+        originalSize = decodeFileFromBufferGray(buf, bufSize, &original, &originalGray, inputFiletype, &width, &height, &jpegcs);
     if (!originalSize)
     {
         error("invalid input file: %s", inputPath);
@@ -210,10 +223,11 @@ int main (int argc, char **argv)
         defish(original, tmpImage, width, height, 3, defishStrength, defishZoom);
         free(original);
         original = tmpImage;
-    }
 
-    // Convert RGB input into Y
-    originalGraySize = grayscale(original, &originalGray, width, height);
+        // Convert RGB input into Y
+        grayscale(original, &originalGray, width, height);
+    }
+    originalGraySize = originalGray ? (unsigned long) width * height : 0;
 
     if (inputFiletype == FILETYPE_JPEG)
     {
@@ -279,9 +293,24 @@ int main (int argc, char **argv)
     metric = metric_corsharp(originalGray, compressedGray, width, height, shRadius);
     metric = MetricSigma(metric);
     cmpMin = qmetric * (float)min - metric;
+    width0 = 2 * (max - min) + 1;
     for (attempt = attempts - 1; attempt >= 0; --attempt)
     {
         quality = (max + min + 1) / 2;
+
+        // Model searches step to the vertex of the parabola through both
+        // edges and the edge replaced last, kept where the attempts left
+        // can still bisect the rest; hybrid bisects when the last step
+        // did not halve the bracket.
+        if (strategy != SEARCH_BISECT && prevKnown && (strategy != SEARCH_HYBRID || 2 * (max - min) <= width0))
+        {
+            modelX[0] = min;
+            modelY[0] = cmpMin;
+            modelX[2] = max;
+            modelY[2] = cmpMax;
+            if (searchVertex(min, max, modelX, modelY, &vertex))
+                quality = searchClamp(min, max, vertex, attempt + 1);
+        }
         progressive = attempt ? 0 : !noProgressive;
         optimize = accurate ? 1 : (attempt ? 0 : 1);
 
@@ -313,13 +342,19 @@ int main (int argc, char **argv)
         else
             info(quiet, " at q=%i: dM %f\n", quality, cmpQ);
 
+        width0 = max - min;
+        prevKnown = 1;
         if (cmpMin < cmpMax)
         {
+            modelX[1] = min;
+            modelY[1] = cmpMin;
             min = MIN(quality, max);
             cmpMin = cmpQ;
         }
         else
         {
+            modelX[1] = max;
+            modelY[1] = cmpMax;
             max = MAX(quality, min);
             cmpMax = cmpQ;
         }
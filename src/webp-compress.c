@@ -12,6 +12,9 @@
 
 const char *COMMENT = "Compressed by webp-compress";
 
+// WebP reaches the same UM at a lower quality setting than JPEG
+#define WEBP_QUALITY_BIAS 10
+
 void usage(char *progname)
 {
     printf("usage: %s [options] input.[jpg|ppm] output.webp\n\n", progname);
@@ -33,6 +36,8 @@ void usage(char *progname)
     printf("  -Q, --quiet                  only print out errors\n");
     printf("  -T, --input-filetype [arg]   set input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
     printf("  -V, --version                output program version\n");
+    printf("      --no-seed                always search the full quality range\n");
+    printf("      --search [arg]           quality search strategy [bisect, secant, hybrid]\n");
 }
 
 int main (int argc, char **argv)
@@ -64,10 +69,21 @@ int main (int argc, char **argv)
     // Quiet mode (less output)
     int quiet = 0;
 
+    // Seed the search range from the source quality?
+    int seed = 1;
+    int sourceQuality = 0;
+
+    // How to pick the next quality to try
+    int strategy = SEARCH_BISECT;
+    quality_search qs;
+    jpeg_header header;
+
+    // Metric of the original luma, prepared once
+    metric_context reference;
+
     unsigned char *buf, *original, *originalGray = NULL, *tmpImage;
     unsigned char *compressed = NULL, *compressedGray;
     long bufSize = 0, originalSize = 0, originalGraySize = 0;
-    long compressedGraySize = 0;
     unsigned long compressedSize = 0, saved;
     uint8_t *decodedImage = NULL;
     int width, height, min, max, attempt, quality;
@@ -93,6 +109,8 @@ int main (int argc, char **argv)
         { "min", required_argument, 0, 'n' },
         { "no-copy", no_argument, 0, 'c' },
         { "no-progressive", no_argument, 0, 'p' },
+        { "no-seed", no_argument, 0, OPT_NOSEED },
+        { "search", required_argument, 0, OPT_SEARCH },
         { "ppm", no_argument, 0, 'r' },
         { "quality", required_argument, 0, 'q' },
         { "quiet", no_argument, 0, 'Q' },
@@ -159,6 +177,12 @@ int main (int argc, char **argv)
         case 'V':
             version();
             return 0;
+        case OPT_NOSEED:
+            seed = 0;
+            break;
+        case OPT_SEARCH:
+            strategy = parseSearch(optarg);
+            break;
         };
     }
 
@@ -208,6 +232,10 @@ int main (int argc, char **argv)
     if (inputFiletype == FILETYPE_AUTO)
         inputFiletype = detectFiletypeFromBuffer(buf, bufSize);
 
+    /* Estimate the source quality from the JPEG headers. */
+    if (inputFiletype == FILETYPE_JPEG && !scanJpegHeader(buf, bufSize, &header, NULL))
+        sourceQuality = header.quality;
+
     /*
      * Read original image and decode. We need the raw buffer contents and its
      * size to obtain meta data and the original file size later.
@@ -252,13 +280,42 @@ int main (int argc, char **argv)
 
     min = qMin;
     max = qMax;
+
+    // Start near the quality the source suggests. An edge of the seeded
+    // range that no trial confirms is reopened once the search converges.
+    if (seed && sourceQuality)
+    {
+        seedQualityRange(method, target, sourceQuality, WEBP_QUALITY_BIAS, &min, &max);
+        info(quiet, "Seeded search range is %i - %i\n", min, max);
+    }
+    searchInit(&qs, strategy, target, min, max);
+
+    // Reference-only parts of the metric are computed once
+    MetricPrepare(&reference, method, originalGray, width, height, 1);
+
+    // Every trial's luma goes into the same buffer
+    compressedGray = malloc((unsigned long) width * height);
+    if (compressedGray == NULL)
+    {
+        error("could not allocate the compressed grayscale image");
+        WebPMemoryWriterClear(&wrt);
+        WebPPictureFree(&pic);
+        free(originalGray);
+        return 1;
+    }
+
     for (attempt = attempts - 1; attempt >= 0; --attempt)
     {
-         quality = (max + min + 1) / 2;
+        /* Terminate early once the search has nothing left to try. */
+        if (searchDone(&qs))
+        {
+            if (attempt && searchWiden(&qs, qMin, qMax, &attempt))
+                info(quiet, "Widening search range to %i - %i\n", qs.min, qs.max);
+            else
+                attempt = 0;
+        }
 
-        /* Terminate early once bisection interval is a singleton. */
-        if (min == max)
-            attempt = 0;
+        quality = searchNext(&qs);
 
         WebPMemoryWriterClear(&wrt);
 
@@ -296,30 +353,21 @@ int main (int argc, char **argv)
         }
 
         // Convert RGB input into Y
-        compressedGraySize = grayscale(decodedImage, &compressedGray, width, height);
+        grayscaleInto(decodedImage, compressedGray, width, height);
 
         // Free the decoded RGB image
         WebPFree(decodedImage);
 
-        if (!compressedGraySize)
-        {
-            error("unable to decode file that was just encoded!");
-            WebPMemoryWriterClear(&wrt);
-            WebPPictureFree(&pic);
-            free(originalGray);
-            return 1;
-        }
-
         if (!attempt)
             info(quiet, "Final optimized ");
 
         // Measure quality difference
-        metric = MetricCalc(method, originalGray, compressedGray, width, height, 1);
+        metric = MetricCalcPrepared(&reference, compressedGray);
         umetric = MetricRescale(method, metric);
         info(quiet, MetricName(method));
 
         if (attempt)
-            info(quiet, " at q=%i (%i - %i): UM %f\n", quality, min, max, umetric);
+            info(quiet, " at q=%i (%i - %i): UM %f\n", quality, qs.min, qs.max, umetric);
         else
             info(quiet, " at q=%i: UM %f\n", quality, umetric);
 
@@ -354,12 +402,8 @@ int main (int argc, char **argv)
                     return 1;
                 }
             }
-            min = MIN(quality, max);
-        }
-        else
-        {
-            max = MAX(quality, min);
         }
+        searchUpdate(&qs, quality, umetric);
 
         // If we aren't done yet, then free the image data
         if (attempt)
@@ -369,6 +413,7 @@ int main (int argc, char **argv)
     }
 
     free(buf);
+    free(compressedGray);
 
     // Calculate and show savings, if any
     percent = compressedSize * 100 / bufSize;
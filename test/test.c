@@ -1,6 +1,23 @@
 #include "../src/jmetrics.h"
 #include "../src/test/describe.h"
 
+// One transcode of a shared source, run as a parallelRun job
+typedef struct
+{
+    jpeg_transcoder *tc;
+    int quality, lumaOnly;
+    unsigned char *jpeg;
+    unsigned long size;
+} transcode_job;
+
+static void runTranscode(void *arg)
+{
+    transcode_job *job = (transcode_job *) arg;
+
+    job->jpeg = NULL;
+    job->size = transcodeJpeg(job->tc, &job->jpeg, job->quality, 0, 1, job->lumaOnly);
+}
+
 describe ("Unit Tests", {
     it ("Should clamp values", {
         assert_equal_float(0.0, clamp(0.0, -10.0, 100.0));
@@ -56,9 +73,33 @@ describe ("Unit Tests", {
         free(image);
     });
 
+    it ("Should average an image down to any size", {
+        unsigned char *image;
+        unsigned char *scaled;
+
+        image = malloc(5 * 3);
+
+        for (int x = 0; x < 5 * 3; x++) {
+            image[x] = (unsigned char) (x * 10);
+        }
+
+        /*
+        [   0  10  20 |  30  40
+           50  60  70 |  80  90
+          100 110 120 | 130 140 ]
+        */
+        areaScale(image, 5, 3, &scaled, 2, 1);
+
+        assert_equal(60, scaled[0]);
+        assert_equal(85, scaled[1]);
+
+        free(scaled);
+        free(image);
+    });
+
     it ("Should generate an image hash", {
         unsigned char *image;
-        unsigned char *hash;
+        uint64_t *hash;
 
         image = malloc(16);
 
@@ -73,21 +114,806 @@ describe ("Unit Tests", {
             image[x] = (unsigned char) ((x % 2) ? 16 - x : x);
         }
 
-        // Hash should be 101010100101010
+        // Hash should be 1010 1010 0101 0101, packed from bit 0 up
         genHash(image, 4, 4, &hash);
 
-        assert_equal(1, hash[0]);
-        assert_equal(0, hash[1]);
-        assert_equal(0, hash[5]);
-        assert_equal(1, hash[9]);
+        assert_equal(0xaa55, (int) hash[0]);
+
+        free(hash);
+        free(image);
+    });
+
+    it ("Should downscale by averaging blocks", {
+        unsigned char *image;
+        unsigned char *scaled;
+        int width;
+        int height;
+
+        image = malloc(3 * 3);
+
+        for (int x = 0; x < 3 * 3; x++) {
+            image[x] = (unsigned char) (x * 10 + 10);
+        }
+
+        downscale(image, &scaled, 3, 3, 1, 2, &width, &height);
+
+        assert_equal(2, width);
+        assert_equal(2, height);
+        assert_equal(30, scaled[0]);
+        assert_equal(45, scaled[1]);
+        assert_equal(75, scaled[2]);
+        assert_equal(90, scaled[3]);
+
+        free(scaled);
+        free(image);
+    });
+
+    it ("Should sample whole tiles", {
+        unsigned char *image;
+        unsigned char *gray;
+        unsigned char *sample;
+        int width;
+        int height;
+
+        image = malloc(128 * 128 * 3);
+
+        for (int x = 0; x < 128 * 128 * 3; x++) {
+            image[x] = (unsigned char) ((x / 3) % 128 < 64 ? 0 : 255);
+        }
+
+        grayscale(image, &gray, 128, 128);
+
+        assert_equal(64 * 64, (int) sampleTiles(image, gray, 128, 128, 64, 25, &sample, &width, &height));
+        assert_equal(64, width);
+        assert_equal(64, height);
+        assert_equal(0, sample[0]);
+
+        free(sample);
+        free(gray);
+        free(image);
+    });
+
+    it ("Should match the scalar pixel kernels at every SIMD level", {
+        unsigned char *a;
+        unsigned char *b;
+        unsigned char *gray;
+        uint64_t sad = 0;
+        uint64_t ssd = 0;
+        uint64_t sum = 0;
+        uint64_t sumSq = 0;
+        uint64_t simdSum;
+        uint64_t simdSumSq;
+        uint64_t hash1[625];
+        uint64_t hash2[625];
+        unsigned int dist = 0;
+        int detected = simdLevel();
+
+        a = malloc(5000);
+        b = malloc(5000);
+        gray = malloc(1666);
+
+        for (int x = 0; x < 5000; x++) {
+            a[x] = (unsigned char) (x * 37 + x / 7);
+            b[x] = (unsigned char) (x * 11 + 255);
+            sad += abs(a[x] - b[x]);
+            ssd += (a[x] - b[x]) * (a[x] - b[x]);
+            sum += a[x] + b[x];
+            sumSq += a[x] * a[x] + b[x] * b[x];
+            for (int bit = 0; bit < 8; bit++)
+                dist += ((a[x] ^ b[x]) >> bit) & 1;
+        }
+
+        memcpy(hash1, a, 5000);
+        memcpy(hash2, b, 5000);
+
+        for (int level = SIMD_SCALAR; level <= detected; level++) {
+            assert_equal(level, simdSelect(level));
+            assert_equal(1, (int) (pixelSad(a, b, 5000) == sad));
+            assert_equal(1, (int) (pixelSsd(a, b, 5000) == ssd));
+            pixelMoments(a, b, 5000, &simdSum, &simdSumSq);
+            assert_equal(1, (int) (simdSum == sum && simdSumSq == sumSq));
+            assert_equal((int) dist, (int) hammingDist(hash1, hash2, 5000 * 8));
+            grayscaleInto(a, gray, 1666, 1);
+            for (int x = 0; x < 1666; x++) {
+                assert_equal((19595 * a[x * 3] + 38470 * a[x * 3 + 1] + 7471 * a[x * 3 + 2] + 32768) >> 16, gray[x]);
+            }
+        }
+
+        free(gray);
+        free(a);
+        free(b);
+    });
+
+    it ("Should sum metric bands the same on any thread count", {
+        unsigned char *a;
+        unsigned char *b;
+        uint64_t single;
+        uint64_t banded;
+        int size = 3 * 1024 * 1024 + 5;
+
+        a = malloc(size);
+        b = malloc(size);
+
+        for (int x = 0; x < size; x++) {
+            a[x] = (unsigned char) (x * 37 + x / 7);
+            b[x] = (unsigned char) (x * 11);
+        }
+
+        MetricSetThreads(1);
+        single = pixelSsd(a, b, size);
+        MetricSetThreads(4);
+        banded = pixelSsd(a, b, size);
+        MetricSetThreads(0);
+
+        assert_equal(1, (int) (single == banded));
+
+        free(a);
+        free(b);
+    });
+
+    it ("Should match MetricCalc with a prepared reference", {
+        unsigned char *a;
+        unsigned char *b;
+        metric_context ctx;
+
+        a = malloc(64 * 48);
+        b = malloc(64 * 48);
+
+        for (int x = 0; x < 64 * 48; x++) {
+            a[x] = (unsigned char) (x * 37 + x / 7);
+            b[x] = (unsigned char) (a[x] + x % 9);
+        }
+
+        MetricPrepare(&ctx, MSEF, a, 64, 48, 1);
+        assert_equal(1, (int) (MetricCalcPrepared(&ctx, b) == MetricCalc(MSEF, a, b, 64, 48, 1)));
+
+        free(a);
+        free(b);
+    });
+
+    it ("Should encode prepared planes like the scanline encoder", {
+        unsigned char *image;
+        unsigned char *jpeg;
+        unsigned char *planar;
+        unsigned long jpegSize;
+        unsigned long planarSize;
+        jpeg_planes planes;
+
+        // Odd and even sizes around whole 4:2:0 MCUs
+        for (int width = 255; width <= 257; width++) {
+            for (int height = 127; height <= 130; height++) {
+                image = malloc(width * height * 3);
+                for (int x = 0; x < width * height * 3; x++) {
+                    image[x] = (unsigned char) (x * 13 + (x / (width * 3)) * 7);
+                }
+
+                for (int subsample = SUBSAMPLE_DEFAULT; subsample <= SUBSAMPLE_422; subsample++) {
+                    planesInit(&planes, image, width, height, JCS_YCbCr, subsample);
+
+                    jpeg = NULL;
+                    planar = NULL;
+                    jpegSize = encodeJpeg(&jpeg, image, width, height, JCS_RGB, 70, JCS_YCbCr, 0, 0, subsample);
+                    planarSize = encodeJpegPlanes(&planar, &planes, 70, 0, 0, 0);
+
+                    // From libjpeg 7 subsampled chroma goes through scaled
+                    // DCTs in encodeJpeg
+                    if (JPEG_LIB_VERSION < 70 || subsample == SUBSAMPLE_444) {
+                        assert_equal((int) jpegSize, (int) planarSize);
+                        assert_equal(0, memcmp(jpeg, planar, jpegSize));
+                    }
+
+                    free(planar);
+                    free(jpeg);
+                    planesFree(&planes);
+                }
+
+                free(image);
+            }
+        }
+    });
+
+    it ("Should requantize a JPEG no finer than its source", {
+        unsigned char *image;
+        unsigned char *source = NULL;
+        unsigned char *gray;
+        unsigned char *lumaGray;
+        unsigned long sourceSize;
+        jpeg_transcoder tc;
+        transcode_job full;
+        transcode_job luma;
+        struct jpeg_decompress_struct dinfo;
+        struct jpeg_error_mgr jerr;
+        JQUANT_TBL *srcQ;
+        JQUANT_TBL *dstQ;
+        int width;
+        int height;
+        int jpegcs;
+
+        image = malloc(67 * 45 * 3);
+
+        for (int x = 0; x < 67 * 45 * 3; x++) {
+            image[x] = (unsigned char) (x * 13 + (x / (67 * 3)) * 7);
+        }
+
+        // Partial MCUs on both edges of a 4:2:0 source
+        sourceSize = encodeJpeg(&source, image, 67, 45, JCS_RGB, 60, JCS_YCbCr, 0, 0, SUBSAMPLE_DEFAULT);
+        assert_equal(0, transcoderInit(&tc, source, sourceSize));
+
+        for (int quality = 30; quality <= 95; quality += 13) {
+            full.tc = &tc;
+            full.quality = quality;
+            full.lumaOnly = 0;
+            runTranscode(&full);
+            luma = full;
+            luma.lumaOnly = 1;
+            runTranscode(&luma);
+
+            assert_equal(1, (int) (decodeJpeg(full.jpeg, full.size, &gray, &width, &height, &jpegcs, JCS_GRAYSCALE) > 0));
+            assert_equal(67, width);
+            assert_equal(45, height);
+            assert_equal(JCS_YCbCr, jpegcs);
+
+            // The luma of a color transcode is the luma-only transcode
+            assert_equal(1, (int) (decodeJpeg(luma.jpeg, luma.size, &lumaGray, &width, &height, &jpegcs, JCS_GRAYSCALE) > 0));
+            assert_equal(JCS_GRAYSCALE, jpegcs);
+            assert_equal(0, memcmp(gray, lumaGray, 67 * 45));
+
+            dinfo.err = jpeg_std_error(&jerr);
+            jpeg_create_decompress(&dinfo);
+            jpeg_mem_src(&dinfo, full.jpeg, full.size);
+            jpeg_read_header(&dinfo, TRUE);
+            assert_equal(3, dinfo.num_components);
+            for (int c = 0; c < 3; c++) {
+                srcQ = tc.cinfo.quant_tbl_ptrs[tc.cinfo.comp_info[c].quant_tbl_no];
+                dstQ = dinfo.quant_tbl_ptrs[dinfo.comp_info[c].quant_tbl_no];
+                for (int k = 0; k < DCTSIZE2; k++) {
+                    assert_equal(1, (int) (dstQ->quantval[k] >= srcQ->quantval[k]));
+                }
+            }
+            jpeg_destroy_decompress(&dinfo);
+
+            free(lumaGray);
+            free(gray);
+            free(luma.jpeg);
+            free(full.jpeg);
+        }
+
+        transcoderFree(&tc);
+        free(source);
+        free(image);
+    });
+
+    it ("Should share a transcoder between threads", {
+        unsigned char *image;
+        unsigned char *source = NULL;
+        unsigned long sourceSize;
+        jpeg_transcoder tc;
+        transcode_job serial[24];
+        transcode_job parallel[24];
+
+        image = malloc(203 * 157 * 3);
+
+        for (int x = 0; x < 203 * 157 * 3; x++) {
+            image[x] = (unsigned char) (x * 7 + (x / (203 * 3)) * 11 + x / 1000);
+        }
+
+        sourceSize = encodeJpeg(&source, image, 203, 157, JCS_RGB, 85, JCS_YCbCr, 0, 0, SUBSAMPLE_DEFAULT);
+        assert_equal(0, transcoderInit(&tc, source, sourceSize));
+
+        for (int i = 0; i < 24; i++) {
+            serial[i].tc = &tc;
+            serial[i].quality = 40 + i * 2;
+            serial[i].lumaOnly = i % 2;
+            runTranscode(&serial[i]);
+            parallel[i] = serial[i];
+        }
+
+        // Every job reads the same source arrays at once
+        parallelRun(runTranscode, parallel, sizeof(transcode_job), 24, 8);
+
+        for (int i = 0; i < 24; i++) {
+            assert_equal((int) serial[i].size, (int) parallel[i].size);
+            assert_equal(0, memcmp(serial[i].jpeg, parallel[i].jpeg, serial[i].size));
+            free(parallel[i].jpeg);
+        }
+
+        // And the source is left as it was
+        for (int i = 0; i < 24; i++) {
+            runTranscode(&parallel[i]);
+            assert_equal(0, memcmp(serial[i].jpeg, parallel[i].jpeg, serial[i].size));
+            free(parallel[i].jpeg);
+            free(serial[i].jpeg);
+        }
+
+        transcoderFree(&tc);
+        free(source);
+        free(image);
+    });
+
+    it ("Should rebuild trial luma without encoding", {
+        unsigned char *image;
+        unsigned char *jpeg = NULL;
+        unsigned char *decoded;
+        unsigned char *trial;
+        unsigned long jpegSize;
+        unsigned long trialSize;
+        jpeg_planes planes;
+        jpeg_dct_luma dct;
+        int width;
+        int height;
+        int jpegcs;
+
+        image = malloc(37 * 23 * 3);
+
+        for (int x = 0; x < 37 * 23 * 3; x++) {
+            image[x] = (unsigned char) (x * 13 + (x / 111) * 5);
+        }
+
+        planesInit(&planes, image, 37, 23, JCS_YCbCr, SUBSAMPLE_DEFAULT);
+        assert_equal(0, dctLumaInit(&dct, &planes));
+
+        jpegSize = encodeJpegPlanes(&jpeg, &planes, 60, 0, 0, 1);
+        decodeJpeg(jpeg, jpegSize, &decoded, &width, &height, &jpegcs, JCS_GRAYSCALE);
+        trialSize = dctLumaTrial(&dct, 60, 0, &trial);
+
+        assert_equal(0, memcmp(decoded, trial, 37 * 23));
+        assert_equal(1, (int) (trialSize <= jpegSize));
+
+        free(trial);
+        free(decoded);
+        free(jpeg);
+        dctLumaFree(&dct);
+        planesFree(&planes);
+        free(image);
+    });
+
+    it ("Should score trial error from the coefficients", {
+        unsigned char *image;
+        unsigned char *gray;
+        unsigned char *trial;
+        jpeg_planes planes;
+        jpeg_dct_luma dct;
+        float decoded;
+        float scored;
+
+        image = malloc(64 * 48 * 3);
+
+        for (int x = 0; x < 64 * 48 * 3; x++) {
+            image[x] = (unsigned char) (x * 13 + (x / 192) * 5);
+        }
+
+        grayscale(image, &gray, 64, 48);
+        planesInit(&planes, image, 64, 48, JCS_YCbCr, SUBSAMPLE_DEFAULT);
+        dctLumaInit(&dct, &planes);
+        dctLumaReference(&dct, &planes, gray);
+
+        dctLumaTrial(&dct, 50, 0, &trial);
+        decoded = MetricCalc(MSE, gray, trial, 64, 48, 1);
+        dctLumaScore(&dct, MSE, 50, 0, 0, &scored);
+
+        assert_equal(1, (int) (fabs(scored - decoded) < decoded * 0.05));
+
+        free(trial);
+        dctLumaFree(&dct);
+        planesFree(&planes);
+        free(gray);
+        free(image);
+    });
+
+    it ("Should score a trial the same from a neighbouring quality", {
+        unsigned char *image;
+        unsigned char *gray;
+        jpeg_planes planes;
+        jpeg_dct_luma fresh;
+        jpeg_dct_luma chained;
+        unsigned long freshSize;
+        unsigned long chainedSize;
+        float freshMetric;
+        float chainedMetric;
+
+        // Smooth gradients on the left, texture on the right
+        image = malloc(96 * 64 * 3);
+
+        for (int x = 0; x < 96 * 64 * 3; x++) {
+            image[x] = (unsigned char) ((x % 288) < 144 ? (x % 288) / 3 + (x / 288) : x * 13 + (x / 288) * 5);
+        }
+
+        grayscale(image, &gray, 96, 64);
+        planesInit(&planes, image, 96, 64, JCS_YCbCr, SUBSAMPLE_DEFAULT);
+        dctLumaInit(&chained, &planes);
+        dctLumaReference(&chained, &planes, gray);
+        dctLumaScore(&chained, MSEF, 30, 0, 1, &chainedMetric);
+
+        for (int quality = 31; quality <= 95; quality++) {
+            dctLumaInit(&fresh, &planes);
+            dctLumaReference(&fresh, &planes, gray);
+
+            freshSize = dctLumaScore(&fresh, MSEF, quality, 0, 1, &freshMetric);
+            chainedSize = dctLumaScore(&chained, MSEF, quality, quality - 1, 1, &chainedMetric);
+
+            assert_equal((int) freshSize, (int) chainedSize);
+            assert_equal_float(freshMetric, chainedMetric);
+
+            dctLumaFree(&fresh);
+        }
+
+        dctLumaFree(&chained);
+        planesFree(&planes);
+        free(gray);
+        free(image);
+    });
+
+    it ("Should defish the same on any thread count", {
+        unsigned char *image;
+        unsigned char *single;
+        unsigned char *banded;
+        defish_map map;
+
+        image = malloc(31 * 17 * 3);
+        single = malloc(31 * 17 * 3);
+        banded = malloc(31 * 17 * 3);
+
+        for (int x = 0; x < 31 * 17 * 3; x++) {
+            image[x] = (unsigned char) (x * 7 + x / 93);
+        }
+
+        assert_equal(0, defishMapInit(&map, 31, 17, 2.6, 1.2));
+        defishMapped(&map, image, single, 3, 1);
+        defishMapped(&map, image, banded, 3, 4);
+
+        assert_equal(0, memcmp(single, banded, 31 * 17 * 3));
+        assert_equal(interpolate(image, 31, 3, 15.5, 8.5, 1), single[(8 * 31 + 15) * 3 + 1]);
+
+        defishMapFree(&map);
+        free(banded);
+        free(single);
+        free(image);
+    });
+
+    it ("Should compare many candidates with one reference", {
+        unsigned char *image;
+        unsigned char *jpeg = NULL;
+        unsigned char *small = NULL;
+        unsigned long jpegSize;
+        unsigned long smallSize;
+        compare_candidate candidates[3];
+        int methods[METHOD_COUNT];
+
+        image = malloc(32 * 16 * 3);
+
+        for (int x = 0; x < 32 * 16 * 3; x++) {
+            image[x] = (unsigned char) (x * 7 + x / 96);
+        }
+
+        jpegSize = encodeJpeg(&jpeg, image, 32, 16, JCS_RGB, 90, JCS_YCbCr, 0, 0, SUBSAMPLE_DEFAULT);
+        smallSize = encodeJpeg(&small, image, 16, 16, JCS_RGB, 90, JCS_YCbCr, 0, 0, SUBSAMPLE_DEFAULT);
+
+        for (int x = 0; x < 3; x++) {
+            candidates[x].buf = (x == 1) ? small : jpeg;
+            candidates[x].bufSize = (x == 1) ? smallSize : jpegSize;
+            candidates[x].filetype = FILETYPE_JPEG;
+        }
+        candidates[2].bufSize = 0;
+
+        assert_equal(2, parseMethods("mse,fast,mse", methods));
+        assert_equal(0, compareManyFromBuffer(methods, 2, 16, jpeg, jpegSize, FILETYPE_JPEG, candidates, 3, 2));
+        assert_equal(COMPARE_OK, candidates[0].status);
+        assert_equal(0, (int) candidates[0].diff[MSE]);
+        assert_equal(0, (int) candidates[0].diff[FAST]);
+        assert_equal(COMPARE_SIZE, candidates[1].status);
+        assert_equal(COMPARE_DECODE, candidates[2].status);
+
+        free(small);
+        free(jpeg);
+        free(image);
+    });
+
+    it ("Should hash a progressive file like a baseline one", {
+        unsigned char *image;
+        unsigned char *baseline = NULL;
+        unsigned char *progressive = NULL;
+        unsigned long baselineSize;
+        unsigned long progressiveSize;
+        uint64_t *baselineHash;
+        uint64_t *progressiveHash;
+
+        image = malloc(256 * 256 * 3);
+
+        for (int x = 0; x < 256 * 256 * 3; x++) {
+            image[x] = (unsigned char) (100 + (x / 3 % 256 * 3 + x / 768 * 5) % 40 + (x / 24 % 32 + x / 6144 * 3) % 5);
+        }
+
+        baselineSize = encodeJpeg(&baseline, image, 256, 256, JCS_RGB, 75, JCS_YCbCr, 0, 0, SUBSAMPLE_DEFAULT);
+        progressiveSize = encodeJpeg(&progressive, image, 256, 256, JCS_RGB, 75, JCS_YCbCr, 1, 0, SUBSAMPLE_DEFAULT);
+
+        // At 32 pixels the file is decoded from its DC alone
+        assert_equal(0, jpegHashFromBuffer(baseline, baselineSize, &baselineHash, 32));
+        assert_equal(0, jpegHashFromBuffer(progressive, progressiveSize, &progressiveHash, 32));
+        assert_equal(0, hammingDist(baselineHash, progressiveHash, 32 * 32));
+
+        free(progressiveHash);
+        free(baselineHash);
+        free(progressive);
+        free(baseline);
+        free(image);
+    });
+
+    it ("Should hash a sequential file with a scan per component like a baseline one", {
+        unsigned char *image;
+        unsigned char *baseline = NULL;
+        unsigned char *multiScan = NULL;
+        unsigned long baselineSize;
+        unsigned long multiScanSize = 0;
+        uint64_t *baselineHash;
+        uint64_t *multiScanHash;
+        struct jpeg_compress_struct cinfo;
+        struct jpeg_error_mgr jerr;
+        jpeg_scan_info scans[3];
+        JSAMPROW row;
+
+        image = malloc(256 * 256 * 3);
+
+        for (int x = 0; x < 256 * 256 * 3; x++) {
+            image[x] = (unsigned char) (100 + (x / 3 % 256 * 3 + x / 768 * 5) % 40 + (x / 24 % 32 + x / 6144 * 3) % 5);
+        }
+
+        baselineSize = encodeJpeg(&baseline, image, 256, 256, JCS_RGB, 75, JCS_YCbCr, 0, 0, SUBSAMPLE_DEFAULT);
 
+        // Non-interleaved, so jpeg_has_multiple_scans is true without
+        // the file being progressive
+        for (int x = 0; x < 3; x++) {
+            scans[x].comps_in_scan = 1;
+            scans[x].component_index[0] = x;
+            scans[x].Ss = 0;
+            scans[x].Se = 63;
+            scans[x].Ah = 0;
+            scans[x].Al = 0;
+        }
+
+        cinfo.err = jpeg_std_error(&jerr);
+        jpeg_create_compress(&cinfo);
+        jpeg_mem_dest(&cinfo, &multiScan, &multiScanSize);
+        cinfo.image_width = 256;
+        cinfo.image_height = 256;
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, 75, TRUE);
+        cinfo.scan_info = scans;
+        cinfo.num_scans = 3;
+        jpeg_start_compress(&cinfo, TRUE);
+        while (cinfo.next_scanline < cinfo.image_height) {
+            row = image + cinfo.next_scanline * 256 * 3;
+            jpeg_write_scanlines(&cinfo, &row, 1);
+        }
+        jpeg_finish_compress(&cinfo);
+        jpeg_destroy_compress(&cinfo);
+
+        assert_equal(0, jpegHashFromBuffer(baseline, baselineSize, &baselineHash, 32));
+        assert_equal(0, jpegHashFromBuffer(multiScan, multiScanSize, &multiScanHash, 32));
+        assert_equal(0, hammingDist(baselineHash, multiScanHash, 32 * 32));
+
+        free(multiScanHash);
+        free(baselineHash);
+        free(multiScan);
+        free(baseline);
+        free(image);
+    });
+
+    it ("Should fail to hash a corrupt file and go on with the next", {
+        unsigned char *image;
+        unsigned char *jpeg = NULL;
+        unsigned char *corrupt;
+        unsigned long jpegSize;
+        uint64_t *hash;
+        int sof = 2;
+
+        image = malloc(64 * 64 * 3);
+
+        for (int x = 0; x < 64 * 64 * 3; x++) {
+            image[x] = (unsigned char) (x * 5 + x / 192);
+        }
+
+        jpegSize = encodeJpeg(&jpeg, image, 64, 64, JCS_RGB, 80, JCS_YCbCr, 0, 0, SUBSAMPLE_DEFAULT);
+        corrupt = malloc(jpegSize);
+        memcpy(corrupt, jpeg, jpegSize);
+
+        while (!(corrupt[sof] == 0xff && corrupt[sof + 1] == 0xc0)) {
+            sof++;
+        }
+
+        // A sample precision libjpeg does not support
+        corrupt[sof + 4] = 13;
+        assert_equal(1, jpegHashFromBuffer(corrupt, jpegSize, &hash, 8));
+
+        // Headers with no image in them
+        assert_equal(1, jpegHashFromBuffer(corrupt, sof, &hash, 8));
+
+        assert_equal(0, jpegHashFromBuffer(jpeg, jpegSize, &hash, 8));
         free(hash);
+
+        free(corrupt);
+        free(jpeg);
         free(image);
     });
 
     it ("Should calculate hamming distance", {
-        int dist = hammingDist((unsigned char *) "101010", (unsigned char *) "111011", 6);
-        assert_equal(2, dist);
+        uint64_t hash1[2];
+        uint64_t hash2[2];
+        int dist;
+
+        hash1[0] = 0x15;
+        hash1[1] = 0x21;
+        hash2[0] = 0x37;
+        hash2[1] = 0x01;
+        dist = hammingDist(hash1, hash2, 70);
+
+        assert_equal(3, dist);
+    });
+
+    it ("Should find the same hashes in an index as by comparing them all", {
+        uint64_t hashes[200][2];
+        hash_index idx;
+        hash_index loaded;
+        FILE *file;
+        int *matches;
+        int *reloaded;
+        int count;
+        int expected;
+
+        hashIndexInit(&idx, 100);
+
+        for (int x = 0; x < 200; x++) {
+            hashes[x][0] = (x % 20) * 0x9e3779b97f4a7c15ULL ^ (uint64_t) (x / 20) << (x % 7);
+            hashes[x][1] = (x % 20) & 0xfULL;
+            assert_equal(x, hashIndexAdd(&idx, hashes[x]));
+        }
+
+        // The loaded copy has its tables built, the first one does not
+        file = tmpfile();
+        assert_equal(0, hashIndexSave(&idx, file));
+        rewind(file);
+        assert_equal(0, hashIndexLoad(&loaded, file));
+        fclose(file);
+
+        for (int x = 0; x < 200; x += 7) {
+            count = hashIndexQuery(&idx, hashes[x], 6, &matches);
+            expected = 0;
+            for (int y = 0; y < 200; y++) {
+                if (hammingDist(hashes[x], hashes[y], 100) <= 6) {
+                    assert_equal(y, matches[expected]);
+                    expected++;
+                }
+            }
+            assert_equal(expected, count);
+
+            assert_equal(count, hashIndexQuery(&loaded, hashes[x], 6, &reloaded));
+            assert_equal(0, memcmp(matches, reloaded, count * sizeof(int)));
+
+            free(reloaded);
+            free(matches);
+        }
+
+        hashIndexFree(&loaded);
+        hashIndexFree(&idx);
+    });
+
+    it ("Should reopen a seeded range that sits above the answer", {
+        quality_search qs;
+        int min = 40;
+        int max = 95;
+        int seedLow;
+        int quality;
+
+        seedQualityRange(SSIM, 0.9999f, 90, 0, &min, &max);
+        seedLow = min;
+        assert_equal(1, (seedLow > 55));
+
+        // UM rises with quality and first reaches the target at 50
+        searchInit(&qs, SEARCH_BISECT, 0.495f, min, max);
+        for (int attempt = 8 - 1; attempt > 0; --attempt) {
+            if (searchDone(&qs) && !searchWiden(&qs, 40, 95, &attempt)) {
+                break;
+            }
+            quality = searchNext(&qs);
+            searchUpdate(&qs, quality, quality / 100.0f);
+        }
+
+        assert_equal(1, searchDone(&qs));
+        assert_equal(50, searchNext(&qs));
+    });
+
+    it ("Should find the answer within the bisection steps with every strategy", {
+        quality_search qs;
+        int steps;
+        int quality;
+        int answer;
+        float metric;
+
+        // Rising UM curves: linear, flat then steep, steep then flat and a
+        // step, crossing the target at every quality. The steep ones keep
+        // an edge far from the target, which stalls an unguarded secant.
+        for (int strategy = SEARCH_BISECT; strategy <= SEARCH_HYBRID; strategy++) {
+            for (int curve = 0; curve < 4; curve++) {
+                for (answer = 41; answer <= 95; answer++) {
+                    searchInit(&qs, strategy, 0.5f, 40, 95);
+                    steps = searchSteps(&qs);
+                    for (int step = 0; step < steps && !searchDone(&qs); step++) {
+                        quality = searchNext(&qs);
+                        if (curve == 0)
+                            metric = 0.5f + (quality - answer) / 100.0f;
+                        else if (curve == 1)
+                            metric = 0.5f * powf(2.0f, (float) (quality - answer));
+                        else if (curve == 2)
+                            metric = 1.0f - 0.5f * powf(2.0f, (float) (answer - quality));
+                        else
+                            metric = (quality >= answer) ? 1.0f : 0.0f;
+                        searchUpdate(&qs, quality, metric);
+                    }
+
+                    assert_equal(1, searchDone(&qs));
+                    assert_equal(answer, searchNext(&qs));
+                }
+            }
+        }
+    });
+
+    it ("Should read a JPEG header without decoding", {
+        unsigned char *image;
+        unsigned char *jpeg = NULL;
+        unsigned long jpegSize;
+        jpeg_header header;
+
+        image = malloc(16 * 8 * 3);
+
+        for (int x = 0; x < 16 * 8 * 3; x++) {
+            image[x] = (unsigned char) (x * 7);
+        }
+
+        jpegSize = encodeJpeg(&jpeg, image, 16, 8, JCS_RGB, 75, JCS_YCbCr, 0, 0, SUBSAMPLE_DEFAULT);
+
+        assert_equal(0, scanJpegHeader(jpeg, jpegSize, &header, "none"));
+        assert_equal(16, header.width);
+        assert_equal(8, header.height);
+        assert_equal(3, header.components);
+        assert_equal(75, header.quality);
+        assert_equal(0, header.processed);
+
+        free(jpeg);
+        free(image);
+    });
+
+    it ("Should skip stray bytes between JPEG markers", {
+        unsigned char *image;
+        unsigned char *jpeg = NULL;
+        unsigned char *padded;
+        unsigned long jpegSize;
+        unsigned long pos;
+        jpeg_header header;
+
+        image = malloc(16 * 8 * 3);
+
+        for (int x = 0; x < 16 * 8 * 3; x++) {
+            image[x] = (unsigned char) (x * 7);
+        }
+
+        jpegSize = encodeJpeg(&jpeg, image, 16, 8, JCS_RGB, 75, JCS_YCbCr, 0, 0, SUBSAMPLE_DEFAULT);
+
+        // Three padding bytes after the APP0 segment
+        pos = 4 + (jpeg[4] << 8) + jpeg[5];
+        padded = malloc(jpegSize + 3);
+        memcpy(padded, jpeg, pos);
+        memset(padded + pos, 0, 3);
+        memcpy(padded + pos + 3, jpeg + pos, jpegSize - pos);
+
+        assert_equal(0, scanJpegHeader(padded, jpegSize + 3, &header, "none"));
+        assert_equal(16, header.width);
+        assert_equal(8, header.height);
+        assert_equal(75, header.quality);
+
+        free(padded);
+        free(jpeg);
+        free(image);
     });
 
     it ("Should decode a PPM", {